@@ -8,6 +8,18 @@
 
 #define EXTERNAL_EEPROM
 //#define USE_WC_EEPROM
+//#define USE_WIFI				// also accept commands over TCP, needs wifi_credentials.h, serial keeps working either way
+//#define USE_STALLGUARD				// StallGuard only works in stealthChop, enabling this switches the driver out of spreadCycle
+
+#ifdef USE_WIFI
+#include <WiFi.h>
+#include <ESPmDNS.h>
+#if __has_include("wifi_credentials.h")
+#include "wifi_credentials.h"		// WIFI_SSID and WIFI_PASSWORD of your network, kept out of git
+#else
+#error "Copy wifi_credentials.example.h to wifi_credentials.h and fill in your network, or comment out USE_WIFI"
+#endif
+#endif
 
 #ifndef EXTERNAL_EEPROM
 #include <EEPROM.h>
@@ -35,22 +47,72 @@
 #define TMC_ADDRESS 0b00	 		// TMC2209 driver address according to MS1 and MS2
 #define R_SENSE 0.1f				// my board uses R100 resistors because of the JLC parts library
 
-#define RMS_CURRENT 600
+#define RMS_CURRENT 600			// default run current in mA
+#define MAX_RMS_CURRENT 1500
+#define HOLD_PERCENT 30				// default standstill current, percent of the run current
+#define HOLD_DELAY 4				// IHOLDDELAY, 0-15, how gradually the current ramps down to IHOLD
+#define POWER_DOWN 20				// TPOWERDOWN, 0-255 in steps of about 21 ms, standstill time before ramping down
 
 #define TEMP 13
 
 #define STEPPER_SPEED 5
 #define STEPPER_ACCELERATION 5
 
-#define SERVO_INCREMENT 1			// in degrees
-#define SERVO_INTERVAL 20			// delay in ms after each servo increment, speed of the servo can be calculated by
-                                    // SERVO_INCREMENT / SERVO_INTERVAL, result is in deg/ms
+#define SERVO_SPEED 50				// default cruise speed in deg/s
+#define SERVO_ACCELERATION 100		// default acceleration and deceleration in deg/s^2
+#define SERVO_MAX_SPEED 600			// limits of what the protocol accepts, a typical servo does 60 deg in 0.1 s
+#define SERVO_MAX_ACCELERATION 999
 
 #define DISABLE_DELAY 15000
 
+#define SLIP_STEPS 4				// commanded steps the encoder may lag behind before a move is aborted
+#define STALL_THRESHOLD 50			// SGTHRS, a stall is detected when SG_RESULT drops below twice this value
+#define STALL_MIN_SPEED 50			// steps/s, StallGuard readings are meaningless below this speed
+#define STALL_INTERVAL 20			// ms between SG_RESULT reads, each one is a UART transaction
+
+#define HOME_FAST_SPEED 1000		// steps/s towards the stop, well above STALL_MIN_SPEED so StallGuard can see it
+#define HOME_SLOW_SPEED 5			// steps/s for the second touch, the encoder detects this one
+#define HOME_ACCELERATION 1000
+#define HOME_BACKOFF_STEPS 10		// steps to back off after the first touch
+#define HOME_CLEARANCE_STEPS 5		// steps to leave between the stop and position 0 afterwards
+#define HOME_TRAVEL_MARGIN 1000		// give up if no stop was found within the travel limit plus this many steps
+
+#define DEFAULT_MAX_POSITION 100000	// travel limit until the driver sends :SL#, the driver's default maximum position
+
+#define SEQUENCE_MAX_STEPS 32		// targets in a focus sequence, see :QA#
+//#define SEQUENCE_TRIGGER_PIN 4		// a rising edge starts the next sequence step like :QN#, e.g. from the camera's exposure output (not routed on the PCB)
+
+#ifndef WIFI_HOSTNAME
+#define WIFI_HOSTNAME "focap"		// reachable as focap.local, give every unit its own in wifi_credentials.h
+#endif
+#define TCP_PORT 9999
+#define MAX_TCP_CLIENTS 4
+
 enum lightStatuses {
 	OFF,
-	ON
+	ON,
+	WAITING							// turns on as soon as the shutter is parked, see >F
+};
+
+enum faults {
+	NO_FAULT,
+	FAULT_SLIP,						// encoder didn't follow the commanded steps
+	FAULT_STALL,					// StallGuard detected a stalled motor
+	FAULT_ENCODER,					// encoder couldn't be read during a move
+	FAULT_HOME						// homing ran its whole travel without finding the stop
+};
+
+enum homeStates {
+	HOME_IDLE,
+	HOME_FAST,						// fast approach, stops on StallGuard or the encoder
+	HOME_BACKOFF,
+	HOME_SLOW,						// slow approach, the position it stops at becomes 0
+	HOME_CLEAR						// move off the stop
+};
+
+enum idleModes {
+	IDLE_HOLD,						// stay enabled, the TMC2209 drops to IHOLD after TPOWERDOWN
+	IDLE_DISABLE					// disable the outputs DISABLE_DELAY after a move
 };
 
 enum shutterStatuses {
@@ -67,7 +129,14 @@ enum addresses {
 	UNPARK_ANGLE_ADDRESS = 3,
 	SHUTTER_STATUS_ADDRESS = 5,
 	STEPPER_OFFSET_ADDRESS = 6,
-    STEPPER_POSITION_ADDRESS = 8
+    STEPPER_POSITION_ADDRESS = 8,
+	SERVO_SPEED_ADDRESS = 12,
+	SERVO_ACCELERATION_ADDRESS = 14,
+	RUN_CURRENT_ADDRESS = 16,
+	HOLD_PERCENT_ADDRESS = 18,
+	HOLD_DELAY_ADDRESS = 19,
+	POWER_DOWN_ADDRESS = 20,
+	IDLE_MODE_ADDRESS = 21
 };
 
 uint8_t lightStatus = OFF;
@@ -85,6 +154,19 @@ DallasTemperature sensors(&oneWire);
 
 ESPServo servo;
 
+// Trapezoidal servo motion, see moveServo()
+uint16_t servoSpeed = SERVO_SPEED;
+uint16_t servoAcceleration = SERVO_ACCELERATION;
+float servoAngle = 0;
+float servoStart = 0;
+float servoDistance = 0;			// signed
+float servoPeak = 0;				// highest speed reached in this move
+float servoAccelTime = 0;
+float servoCruiseTime = 0;
+uint32_t millisServoStart = 0;
+bool servoRunning = false;
+int lastServoWrite = -1;
+
 float temperatureCoefficient = 1.5f;		// calculated expansion coefficient in steps/K (scope dependent)
 
 uint32_t lastSavedPosition = 0;
@@ -97,12 +179,116 @@ int16_t stepperOffset = 0;
 
 bool temperatureCompensation = false;
 
+uint16_t runCurrent = RMS_CURRENT;
+uint8_t holdPercent = HOLD_PERCENT;
+uint8_t holdDelay = HOLD_DELAY;
+uint8_t powerDown = POWER_DOWN;
+uint8_t idleMode = IDLE_HOLD;
+
+enum profilePhases {
+	PHASE_ENCODER,
+	PHASE_STEPPER,
+	PHASE_SERVO,
+	PHASE_STORAGE,
+	PHASE_COMMANDS,
+	PHASE_LOOP,						// whole loop()
+	PROFILE_PHASES
+};
+
+struct phaseStats {
+	uint32_t min;					// all in CPU cycles
+	uint32_t max;
+	uint64_t sum;
+	uint32_t count;
+};
+
+#define HISTOGRAM_BUCKETS 8
+const uint32_t histogramLimits[HISTOGRAM_BUCKETS - 1] = { 50, 100, 200, 500, 1000, 2000, 5000 };		// upper bounds in us
+
+phaseStats profile[PROFILE_PHASES];
+uint16_t loopHistogram[HISTOGRAM_BUCKETS];
+uint32_t maxRunGap = 0;					// longest time between two stepper.run() calls during a move
+uint32_t lastRunCycles = 0;
+
+int32_t maxPosition = DEFAULT_MAX_POSITION;		// travel limit in the driver's coordinates, relative and timed moves stay inside [0, maxPosition]
+uint32_t millisTimedMoveEnd = 0;
+bool timedMove = false;
+
+uint8_t fault = NO_FAULT;
+int32_t progressPosition = 0;			// encoder position when the motor last showed progress
+int32_t stepsSinceProgress = 0;			// steps issued since then
+uint32_t millisLastStallCheck = 0;
+bool encoderError = false;
+uint8_t homeState = HOME_IDLE;
+
+int32_t sequence[SEQUENCE_MAX_STEPS];	// focus sequence targets in the driver's coordinates
+uint8_t sequenceLength = 0;
+uint8_t sequenceNext = 0;				// step the next :QN# starts
+int16_t sequenceBacklash = 0;			// > 0 approaches every target from below, < 0 from above, by overshooting this many steps
+bool approachPending = false;			// overshot, the final leg to approachTarget is still to come
+int32_t approachTarget = 0;
+#ifdef SEQUENCE_TRIGGER_PIN
+bool lastTrigger = false;
+#endif
+
+bool timestamps = false;				// append the micros() a value was sampled at to GP, GM, GT and >S replies
+uint32_t microsPositionSampled = 0;
+
+Stream* replyPort = &Serial;			// stream the command being handled came from, responses go back there
+
+#ifdef USE_WIFI
+WiFiServer server(TCP_PORT);
+WiFiClient clients[MAX_TCP_CLIENTS];
+#endif
+
+// The Arduino builder generates these itself, they're spelled out so the sketch also builds as plain C++ (firmware_host)
+uint32_t profilePhase(uint8_t phase, uint32_t start);
+void profileLoop(uint32_t start);
+void resetProfile();
+void printProfile();
+void readCommand(Stream& port);
+void printStamped(const char* text, uint32_t sampled);
+void acceptClients();
+void focuserCommand(char* command);
+void flatcapCommand(char* command);
+void applyCurrents();
+void saveCurrents();
+void checkStall();
+void abortMove(uint8_t reason);
+void clearFault();
+void startMove(int32_t target);
+int32_t motorPosition(int64_t position);
+uint32_t driverPosition(int32_t position);
+void stopMove();
+void startHoming();
+void runHoming();
+void homeStopReached();
+void endHoming(uint8_t result);
+int16_t nextSequenceStep();
+void runApproach();
+bool isMoving();
+void moveServo(uint16_t angle);
+void runServo();
+void setShutter(int shutter);
+void setBrightness(uint8_t value);
+uint32_t hexStringToLong(String str);
+int readEncoderCounts();
+int32_t getEncoderPosition();
+void restoreEncoderPosition(int32_t position);
+void eepromWriteLong(uint16_t address, uint32_t data, int length);
+uint32_t eepromReadLong(uint16_t address, int length);
+void eepromWriteByte(int address, byte data, bool protectWrite);
+byte eepromReadByte(int address);
+
 void setup() {
     pinMode(LED, OUTPUT);
     pinMode(EN, OUTPUT);
 	pinMode(STEP, OUTPUT);
 	pinMode(DIR, OUTPUT);
 	pinMode(SERVO, OUTPUT);
+	#ifdef SEQUENCE_TRIGGER_PIN
+	pinMode(SEQUENCE_TRIGGER_PIN, INPUT_PULLDOWN);
+	#endif
 	
 	Serial.begin(9600);
 	Serial2.begin(115200, SERIAL_8N1, RX, TX);
@@ -135,20 +321,61 @@ void setup() {
 
 	stepperOffset = (int16_t)eepromReadLong(STEPPER_OFFSET_ADDRESS, 2);
 	stepper.currentPosition = static_cast<int32_t>(eepromReadLong(STEPPER_POSITION_ADDRESS, 4));
+	restoreEncoderPosition(stepper.currentPosition);
+
+	servoSpeed = (uint16_t)eepromReadLong(SERVO_SPEED_ADDRESS, 2);
+	servoAcceleration = (uint16_t)eepromReadLong(SERVO_ACCELERATION_ADDRESS, 2);
+
+	runCurrent = (uint16_t)eepromReadLong(RUN_CURRENT_ADDRESS, 2);
+	holdPercent = eepromReadByte(HOLD_PERCENT_ADDRESS);
+	holdDelay = eepromReadByte(HOLD_DELAY_ADDRESS);
+	powerDown = eepromReadByte(POWER_DOWN_ADDRESS);
+	idleMode = eepromReadByte(IDLE_MODE_ADDRESS);
 	#endif
+	if(runCurrent == 0 || runCurrent > MAX_RMS_CURRENT) {			// blank EEPROM
+		runCurrent = RMS_CURRENT;
+	}
+	if(holdPercent > 100) {
+		holdPercent = HOLD_PERCENT;
+	}
+	if(holdDelay > 15) {
+		holdDelay = HOLD_DELAY;
+	}
+	if(powerDown == 0xFF) {
+		powerDown = POWER_DOWN;
+	}
+	if(idleMode > IDLE_DISABLE) {
+		idleMode = IDLE_HOLD;
+	}
+	if(shutterStatus > UNPARKING) {
+		shutterStatus = PARKED;
+	}
+	if(servoSpeed == 0 || servoSpeed > SERVO_MAX_SPEED) {			// blank EEPROM reads 0xFFFF
+		servoSpeed = SERVO_SPEED;
+	}
+	if(servoAcceleration == 0 || servoAcceleration > SERVO_MAX_ACCELERATION) {
+		servoAcceleration = SERVO_ACCELERATION;
+	}
 	servo.attach(SERVO, 0, 270);
-	servo.sync((shutterStatus == PARKED) ? parkAngle : unparkAngle);
-	servo.setSpeed(SERVO_INCREMENT, SERVO_INTERVAL);
+	servoAngle = (shutterStatus == PARKED) ? parkAngle : unparkAngle;
+	servo.sync(servoAngle);
 
     ledcAttach(LED, 1000, 8);				// make sure that the MOSFET's gate charge is small enough for maximum pin current of 20 mA
 	ledcWrite(LED, 0);
 
 	TMCdriver.begin();
 	TMCdriver.toff(3);						// enables driver in software
-	TMCdriver.rms_current(RMS_CURRENT);
+	applyCurrents();
 	TMCdriver.microsteps(0);
 
+	#ifdef USE_STALLGUARD
+	TMCdriver.en_spreadCycle(false);
+	TMCdriver.pwm_autoscale(true);
+	TMCdriver.SGTHRS(STALL_THRESHOLD);
+	TMCdriver.TCOOLTHRS(0xFFFFF);			// keep StallGuard active at every speed, low speeds are filtered in checkStall()
+	#else
 	TMCdriver.en_spreadCycle(true);
+	#endif
 	//TMCdriver.pwm_autoscale(false);			// true for stealthChop
 	TMCdriver.I_scale_analog(false);
 	TMCdriver.pdn_disable(true);
@@ -158,6 +385,7 @@ void setup() {
 	stepper.setPinsInverted(true, false, true);		// dir, step, en
 	stepper.setEnablePin(EN);
 	stepper.disableOutputs();
+	isEnabled = false;
 
 	millisLastMove = millis();
 
@@ -165,27 +393,81 @@ void setup() {
 	stepper.targetPosition = stepper.currentPosition;
 
 	sensors.begin();
+	resetProfile();
+
+	#ifdef USE_WIFI
+	WiFi.mode(WIFI_STA);
+	WiFi.setHostname(WIFI_HOSTNAME);
+	WiFi.setSleep(false);					// modem sleep adds up to 100 ms of latency to every reply
+	WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+	MDNS.begin(WIFI_HOSTNAME);				// the router hands out the address, the driver finds it by name
+	MDNS.addService("focap", "tcp", TCP_PORT);
+	server.begin();
+	server.setNoDelay(true);
+	#endif
+
 	delay(1000);
 }
 
 void loop() {
+	uint32_t loopStart = ESP.getCycleCount();
+	uint32_t phaseStart = loopStart;
+	microsPositionSampled = micros();
 	stepper.currentPosition = (int32_t)(0.5 + getEncoderPosition() / ENCODER_MOTOR_RATIO);
+	phaseStart = profilePhase(PHASE_ENCODER, phaseStart);
 	if(movingAllowed) {
+		checkStall();
+	}
+	if(homeState != HOME_IDLE) {
+		runHoming();
+	}
+	if(approachPending) {
+		runApproach();
+	}
+	#ifdef SEQUENCE_TRIGGER_PIN
+	bool trigger = digitalRead(SEQUENCE_TRIGGER_PIN) == HIGH;
+	if(trigger && !lastTrigger && !isMoving()) {		// a trigger during a step would cut it short
+		nextSequenceStep();
+	}
+	lastTrigger = trigger;
+	#endif
+	if(timedMove && (int32_t)(millis() - millisTimedMoveEnd) >= 0) {
+		stepper.stop();				// decelerates, the move ends a few steps later
+		timedMove = false;
+	}
+	if(movingAllowed) {
+		int32_t before = stepper.currentPosition;
+		uint32_t now = ESP.getCycleCount();
+		if(lastRunCycles != 0 && now - lastRunCycles > maxRunGap) {
+			maxRunGap = now - lastRunCycles;
+		}
+		lastRunCycles = now;
 		stepper.run();
+		if(stepper.currentPosition != before) {
+			stepsSinceProgress++;
+		}
+	} else {
+		lastRunCycles = 0;			// gaps while standing still don't matter
 	}
-	servo.run();
-	if(!servo.isRunning()) {
+	phaseStart = profilePhase(PHASE_STEPPER, phaseStart);
+	runServo();
+	phaseStart = profilePhase(PHASE_SERVO, phaseStart);
+	if(!servoRunning) {
 		if(shutterStatus == PARKING) {
 			shutterStatus = PARKED;
 		} else if(shutterStatus == UNPARKING) {
 			shutterStatus = UNPARKED;
 		}
 	}
+	if(lightStatus == WAITING && shutterStatus == PARKED) {
+		ledcWrite(LED, brightness);
+		lightStatus = ON;
+	}
 	if(stepper.distanceToGo() != 0) {
 		millisLastMove = millis();
 	} else {
 		if(millis() - millisLastMove > DISABLE_DELAY) {
-			if(lastSavedPosition != stepper.currentPosition && movingAllowed) {
+			if(lastSavedPosition != (uint32_t)stepper.currentPosition && movingAllowed) {
 				movingAllowed = false;
 				#ifndef EXTERNAL_EEPROM
 				EEPROM.put(ENCODER_COUNTS_ADDRESS, counts);
@@ -197,13 +479,96 @@ void loop() {
 				#endif
 				lastSavedPosition = stepper.currentPosition;
 			}
-			if(isEnabled) {
+			if(isEnabled && idleMode == IDLE_DISABLE) {
 				stepper.disableOutputs();
 				isEnabled = false;
 			}
 		}
 	}
-    if(Serial.available() < 3) {
+	phaseStart = profilePhase(PHASE_STORAGE, phaseStart);
+	readCommand(Serial);
+	#ifdef USE_WIFI
+	acceptClients();
+	for(int c = 0; c < MAX_TCP_CLIENTS; c++) {
+		if(clients[c] && clients[c].connected()) {
+			readCommand(clients[c]);
+		}
+	}
+	#endif
+	profilePhase(PHASE_COMMANDS, phaseStart);
+	profileLoop(loopStart);
+}
+
+/*
+Loop profiler, everything is kept in CPU cycles and only converted to microseconds when reported,
+so a phase costs two cycle counter reads and a few adds.
+*/
+uint32_t profilePhase(uint8_t phase, uint32_t start) {
+	uint32_t now = ESP.getCycleCount();
+	uint32_t duration = now - start;
+	phaseStats& stats = profile[phase];
+	if(duration < stats.min) {
+		stats.min = duration;
+	}
+	if(duration > stats.max) {
+		stats.max = duration;
+	}
+	stats.sum += duration;
+	stats.count++;
+	return now;
+}
+
+void profileLoop(uint32_t start) {
+	uint32_t duration = profilePhase(PHASE_LOOP, start) - start;
+	uint32_t us = duration / ESP.getCpuFreqMHz();
+	uint8_t bucket = 0;
+	while(bucket < HISTOGRAM_BUCKETS - 1 && us >= histogramLimits[bucket]) {
+		bucket++;
+	}
+	if(loopHistogram[bucket] < 0xFFFF) {
+		loopHistogram[bucket]++;
+	}
+}
+
+void resetProfile() {
+	for(int i = 0; i < PROFILE_PHASES; i++) {
+		profile[i].min = UINT32_MAX;
+		profile[i].max = 0;
+		profile[i].sum = 0;
+		profile[i].count = 0;
+	}
+	for(int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		loopHistogram[i] = 0;
+	}
+	maxRunGap = 0;
+}
+
+void printProfile() {
+	uint32_t mhz = ESP.getCpuFreqMHz();
+	char temp[8];
+	for(int i = 0; i < PROFILE_PHASES; i++) {
+		phaseStats& stats = profile[i];
+		uint32_t avg = stats.count ? (uint32_t)(stats.sum / stats.count) : 0;
+		uint32_t values[3] = { stats.count ? stats.min : 0, avg, stats.max };
+		for(int j = 0; j < 3; j++) {
+			snprintf(temp, sizeof(temp), "%04x", (uint16_t)min((uint32_t)0xFFFF, values[j] / mhz));
+			replyPort->print(temp);
+		}
+	}
+	for(int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		snprintf(temp, sizeof(temp), "%04x", loopHistogram[i]);
+		replyPort->print(temp);
+	}
+	snprintf(temp, sizeof(temp), "%04x#", (uint16_t)min((uint32_t)0xFFFF, maxRunGap / mhz));
+	replyPort->print(temp);
+}
+
+/*
+Commands from every port are handled one at a time from loop(), so serial and TCP clients
+can't interleave inside a command. Each response goes only to the port that asked.
+*/
+void readCommand(Stream& port) {
+	if(port.available() < 3) {
 		return;
 	}
     char buffer[BUFFER_SIZE];
@@ -211,11 +576,11 @@ void loop() {
 	int i = 0;
 	bool isFocuserCommand = false;
 	bool read = false;
-	while(Serial.available()) {
+	while(port.available()) {
 		if(i >= BUFFER_SIZE - 2) {
 			break;
 		}
-		char temp = Serial.read();
+		char temp = port.read();
 		bool end = false;
 		switch(temp) {
 			case ':': {
@@ -246,6 +611,7 @@ void loop() {
 		}
 	}
 	buffer[i] = '\0';
+	replyPort = &port;
 	if(isFocuserCommand && i > 0) {
 		focuserCommand(buffer);
 	} else if(i > 3) {
@@ -253,6 +619,26 @@ void loop() {
 	}
 }
 
+#ifdef USE_WIFI
+
+void acceptClients() {
+	WiFiClient incoming = server.accept();
+	if(!incoming) {
+		return;
+	}
+	for(int c = 0; c < MAX_TCP_CLIENTS; c++) {
+		if(!clients[c] || !clients[c].connected()) {
+			clients[c].stop();
+			clients[c] = incoming;
+			clients[c].setNoDelay(true);
+			return;
+		}
+	}
+	incoming.stop();		// all slots taken
+}
+
+#endif
+
 void focuserCommand(char* command) {
 	String commandString = String(command);
 	String cmd, param;
@@ -266,52 +652,154 @@ void focuserCommand(char* command) {
 		param = commandString.substring(2);
 	}
 	if(cmd.equals("GP")) {		// get the current motor position
-		char temp[6];
-		sprintf(temp, "%04lx#", stepper.currentPosition + stepperOffset);
-		Serial.print(temp);
+		char temp[12];
+		snprintf(temp, sizeof(temp), "%04" PRIx32 "#", driverPosition(stepper.currentPosition));
+		printStamped(temp, microsPositionSampled);
 	} else if(cmd.equals("GN")) {		// get the target motor position
-		char temp[6];
-		sprintf(temp, "%04lx#", stepper.targetPosition + stepperOffset);
-		Serial.print(temp);
+		char temp[12];
+		snprintf(temp, sizeof(temp), "%04" PRIx32 "#", driverPosition(stepper.targetPosition));
+		replyPort->print(temp);
+	} else if(cmd.equals("GM")) {		// get motion state: position, target, speed, max speed, acceleration
+		char temp[32];
+		snprintf(temp, sizeof(temp), "%08" PRIx32 "%08" PRIx32 "%04x%04x%04x#", driverPosition(stepper.currentPosition), driverPosition(stepper.targetPosition),
+			(uint16_t)(int16_t)(movingAllowed ? stepper.speed() * 16 : 0), (uint16_t)(STEPPER_SPEED * 16), (uint16_t)(STEPPER_ACCELERATION * 16));
+		printStamped(temp, microsPositionSampled);
 	} else if(cmd.equals("GT")) {		// get the current temperature from DS1820 temperature sensor
 		sensors.requestTemperatures();
+		uint32_t sampled = micros();			// the conversion blocks, it's done now
 		int32_t rawTemperature = sensors.getTempByIndex(0);
 		char temp[6];
-		sprintf(temp, "%04x#", (rawTemperature >= -7040 || rawTemperature <= 16000) ? ((uint16_t)(rawTemperature + (1 << 15))) : 0);
-		Serial.print(temp);
+		snprintf(temp, sizeof(temp), "%04x#", (rawTemperature >= -7040 || rawTemperature <= 16000) ? ((uint16_t)(rawTemperature + (1 << 15))) : 0);
+		printStamped(temp, sampled);
 	} else if(cmd.equals("GC")) {		// get the temperature coefficient
 		char temp[6];
-		sprintf(temp, "%04x#", (uint16_t)(temperatureCoefficient * 256.0f));
-		Serial.print(temp);
+		snprintf(temp, sizeof(temp), "%04x#", (uint16_t)(temperatureCoefficient * 256.0f));
+		replyPort->print(temp);
 	} else if(cmd.equals("SC")) {		// set the temperature coefficient
 		temperatureCoefficient = (float)hexStringToLong(param) / 256.0f;		// TODO: specify degree of precision
 	} else if(cmd.equals("GI")) {		// motor is moving - 1 if moving, 0 otherwise
-		Serial.print(stepper.isRunning() && movingAllowed ? "1#" : "0#");
+		replyPort->print(isMoving() ? "1#" : "0#");
 	} else if(cmd.equals("SP")) {		// sync motor
 		stepperOffset = hexStringToLong(param) - stepper.currentPosition;
 	} else if(cmd.equals("SN")) {		// set target motor position
-		stepper.enableOutputs();
-		isEnabled = true;
-		movingAllowed = true;
-		stepper.moveTo(hexStringToLong(param) - stepperOffset);
+		timedMove = false;
+		endHoming(NO_FAULT);
+		startMove(hexStringToLong(param) - stepperOffset);
+	} else if(cmd.equals("MR")) {		// move by signed hex steps from the current position, replies with the new target
+		int64_t target = (int64_t)stepper.currentPosition + stepperOffset + (int32_t)strtol(param.c_str(), NULL, 16);
+		target = constrain(target, (int64_t)0, (int64_t)maxPosition);
+		timedMove = false;
+		endHoming(NO_FAULT);
+		startMove(motorPosition(target));
+		char temp[12];
+		snprintf(temp, sizeof(temp), "%08" PRIx32 "#", (uint32_t)target);
+		replyPort->print(temp);
+	} else if(cmd.equals("MT")) {		// timed move, first digit direction (0 in, 1 out), then duration in hex ms
+		int64_t limit = param.startsWith("1") ? maxPosition : 0;
+		endHoming(NO_FAULT);
+		startMove(motorPosition(limit));
+		millisTimedMoveEnd = millis() + hexStringToLong(param.substring(1));
+		timedMove = true;
+	} else if(cmd.equals("SL")) {		// set the travel limit for relative and timed moves
+		maxPosition = (int32_t)min((uint32_t)strtoul(param.c_str(), NULL, 16), (uint32_t)INT32_MAX);
 	} else if(cmd.equals("FQ")) {		// stop a move
-		stepper.stop();
-		stepper.disableOutputs();
-		isEnabled = false;
-		movingAllowed = false;
-	} else if(cmd.equals("GE")) {		// get encoder counts
+		stopMove();
+	} else if(cmd.equals("PH")) {		// find the inner stop and make it position 0, see startHoming()
+		startHoming();
+	} else if(cmd.equals("GZ")) {		// get homing state, see enum homeStates
+		char temp[4];
+		snprintf(temp, sizeof(temp), "%02x#", homeState);
+		replyPort->print(temp);
+	} else if(cmd.equals("QC")) {		// clear the focus sequence
+		sequenceLength = 0;
+		sequenceNext = 0;
+	} else if(cmd.equals("QA")) {		// append a target to the focus sequence, replies with the number of targets
+		if(sequenceLength < SEQUENCE_MAX_STEPS) {
+			sequence[sequenceLength++] = (int32_t)hexStringToLong(param);
+		}
+		char temp[4];
+		snprintf(temp, sizeof(temp), "%02x#", sequenceLength);
+		replyPort->print(temp);
+	} else if(cmd.equals("QB")) {		// set the sequence approach, overshoot in signed hex steps, see nextSequenceStep()
+		sequenceBacklash = (int16_t)strtol(param.c_str(), NULL, 16);
+	} else if(cmd.equals("QN")) {		// start the next sequence step, replies with its index and target, ff if there is none
+		int16_t step = nextSequenceStep();
+		char temp[12];
+		snprintf(temp, sizeof(temp), "%02x%08" PRIx32 "#", (uint8_t)(step < 0 ? 0xff : step), (uint32_t)(step < 0 ? driverPosition(stepper.targetPosition) : sequence[step]));
+		replyPort->print(temp);
+	} else if(cmd.equals("GQ")) {		// get the sequence state: next step and number of steps
 		char temp[6];
-		sprintf(temp, "%04x#", readEncoderCounts());
-		Serial.print(temp);
+		snprintf(temp, sizeof(temp), "%02x%02x#", sequenceNext, sequenceLength);
+		replyPort->print(temp);
+	} else if(cmd.equals("GH")) {		// get motor currents: run mA, hold %, IHOLDDELAY, TPOWERDOWN, idle mode
+		char temp[16];
+		snprintf(temp, sizeof(temp), "%04x%02x%02x%02x%1d#", runCurrent, holdPercent, holdDelay, powerDown, idleMode);
+		replyPort->print(temp);
+	} else if(cmd.equals("SR")) {		// set run current in mA
+		uint16_t value = (uint16_t)hexStringToLong(param);
+		if(value > 0 && value <= MAX_RMS_CURRENT) {
+			runCurrent = value;
+			saveCurrents();
+		}
+	} else if(cmd.equals("SH")) {		// set hold current in percent of the run current
+		uint8_t value = (uint8_t)hexStringToLong(param);
+		if(value <= 100) {
+			holdPercent = value;
+			saveCurrents();
+		}
+	} else if(cmd.equals("SD")) {		// set IHOLDDELAY
+		holdDelay = (uint8_t)hexStringToLong(param) & 0x0F;
+		saveCurrents();
+	} else if(cmd.equals("SW")) {		// set TPOWERDOWN
+		powerDown = (uint8_t)hexStringToLong(param);
+		saveCurrents();
+	} else if(cmd.equals("SM")) {		// set idle mode, 0 hold current, 1 disable outputs
+		idleMode = param.startsWith("1") ? IDLE_DISABLE : IDLE_HOLD;
+		saveCurrents();
+		if(idleMode == IDLE_HOLD && !isEnabled) {
+			stepper.enableOutputs();
+			isEnabled = true;
+		}
+	} else if(cmd.equals("GL")) {		// get loop profile and reset it
+		printProfile();
+		resetProfile();
+	} else if(cmd.equals("GF")) {		// get fault code of the last move, see enum faults
+		char temp[4];
+		snprintf(temp, sizeof(temp), "%02x#", fault);
+		replyPort->print(temp);
+	} else if(cmd.equals("GE")) {		// get encoder counts
+		char temp[12];
+		snprintf(temp, sizeof(temp), "%04x#", readEncoderCounts());
+		replyPort->print(temp);
+	} else if(cmd.equals("GU")) {		// get micros(), for the driver to relate device and host time
+		char temp[12];
+		snprintf(temp, sizeof(temp), "%08" PRIx32 "#", (uint32_t)micros());
+		replyPort->print(temp);
+	} else if(cmd.equals("TS")) {		// toggle reply timestamps, 1 to enable, 0 to disable
+		timestamps = param.startsWith("1");
 	} else if(cmd.equals("TC")) {		// toggle temperature compensation, 1 to enable, 0 to disable
 		temperatureCompensation = param.startsWith("1");
 	}
 }
 
+/*
+Prints a reply ending in '#', with timestamps enabled as "value@tttttttt#" where tttttttt is the
+micros() the value was sampled at in hex
+*/
+void printStamped(const char* text, uint32_t sampled) {
+	if(!timestamps) {
+		replyPort->print(text);
+		return;
+	}
+	char stamped[48];
+	snprintf(stamped, sizeof(stamped), "%.*s@%08" PRIx32 "#", (int)strlen(text) - 1, text, sampled);
+	replyPort->print(stamped);
+}
+
 void flatcapCommand(char* command) {
-	char temp[9] = {0};
+	char temp[16] = {0};
     char* dat = command + 1;
-	char data[3] = {0};
+	char data[4] = {0};
 	strncpy(data, dat, 3);
     switch(*command) {
         /*
@@ -320,20 +808,21 @@ void flatcapCommand(char* command) {
         Return : *P000#
         */
         case 'P': {
-            Serial.print("*P000#");
+            replyPort->print("*P000#");
 			break;
         }
 		/*
     	Get device status:
     	Request: >S000#
-    	Return : *SFLC#
+    	Return : *SFLCE#, *SFLCE@tttttttt# with timestamps enabled (:TS1#)
 		F  = focuser (0 still, 1 moving)
-    	L  = light status (0 off, 1 on)
+    	L  = light status (0 off, 1 on, 2 on once the shutter is parked)
     	C  = shutter status (0 parked, 1 unparked, 2 parking, 3 unparking)
+		E  = focuser fault (0 none, 1 slip, 2 stall, 3 encoder, 4 home not found)
         */
         case 'S': {
-            sprintf(temp, "*S%1d%1d%1d#", (uint8_t)stepper.isRunning(), lightStatus, shutterStatus);
-            Serial.print(temp);
+            snprintf(temp, sizeof(temp), "*S%1d%1d%1d%1d#", (uint8_t)isMoving(), lightStatus, shutterStatus, fault);
+            printStamped(temp, micros());
 			break;
         }
         /*
@@ -345,7 +834,7 @@ void flatcapCommand(char* command) {
     	    setShutter(UNPARKED);
 			ledcWrite(LED, 0);
 			lightStatus = OFF;
-    	    Serial.print(">O000#");
+    	    replyPort->print(">O000#");
 			break;
         }
         /*
@@ -355,7 +844,7 @@ void flatcapCommand(char* command) {
         */
         case 'C': {
     	    setShutter(PARKED);
-    	    Serial.print("*C000#");
+    	    replyPort->print("*C000#");
 			break;
         }
         /*
@@ -368,7 +857,7 @@ void flatcapCommand(char* command) {
     	    	ledcWrite(LED, brightness);
 				lightStatus = ON;
 			}
-    	    Serial.print("*L000#");
+    	    replyPort->print("*L000#");
 			break;
         }
         /*
@@ -379,7 +868,7 @@ void flatcapCommand(char* command) {
         case 'D': {
 			ledcWrite(LED, 0);
 			lightStatus = OFF;
-    	    Serial.print("*D000#");
+    	    replyPort->print("*D000#");
 			break;
         }
         /*
@@ -389,18 +878,38 @@ void flatcapCommand(char* command) {
     	Return : *Bxxx#
         */
         case 'B': {
-    	    brightness = atoi(data) % 256;
-			#ifndef EXTERNAL_EEPROM
-			EEPROM.update(BRIGHTNESS_ADDRESS, brightness);
-			EEPROM.commit();
-			#else
-			eepromWriteByte(BRIGHTNESS_ADDRESS, (byte)brightness, false);
-			#endif
-    	    if(lightStatus == ON && shutterStatus == PARKED) {
-    	    	ledcWrite(LED, brightness);
-            }
-    	    sprintf(temp, "*B%03d#", brightness);
-            Serial.print(temp);
+    	    setBrightness(atoi(data) % 256);
+    	    snprintf(temp, sizeof(temp), "*B%03d#", brightness);
+            replyPort->print(temp);
+			break;
+        }
+		/*
+    	Get ready for flats: park the shutter, set the brightness and turn the light on once parked
+    	Request: >Fxxx#
+    	xxx = brightness from 000-255
+    	Return : *Fxxx#
+		The light status in >S000# reads 2 until the shutter is parked and the light is on
+        */
+        case 'F': {
+    	    setBrightness(atoi(data) % 256);
+			if(shutterStatus != PARKED) {
+				setShutter(PARKED);
+			}
+			lightStatus = WAITING;
+    	    snprintf(temp, sizeof(temp), "*F%03d#", brightness);
+            replyPort->print(temp);
+			break;
+        }
+		/*
+    	Finish flats: turn the light off and unpark the shutter
+    	Request: >E000#
+    	Return : *E000#
+        */
+        case 'E': {
+			ledcWrite(LED, 0);
+			lightStatus = OFF;
+    	    setShutter(UNPARKED);
+    	    replyPort->print("*E000#");
 			break;
         }
 		/*
@@ -418,10 +927,10 @@ void flatcapCommand(char* command) {
 			eepromWriteLong(PARK_ANGLE_ADDRESS, (uint32_t)parkAngle, 2);
 			#endif
     	    if(shutterStatus == PARKED || shutterStatus == PARKING) {
-				servo.move(parkAngle);
+				moveServo(parkAngle);
             }
-    	    sprintf(temp, "*Z%03d#", parkAngle);
-            Serial.print(temp);
+    	    snprintf(temp, sizeof(temp), "*Z%03d#", parkAngle);
+            replyPort->print(temp);
 			break;
         }
 		/*
@@ -439,10 +948,10 @@ void flatcapCommand(char* command) {
 			eepromWriteLong(UNPARK_ANGLE_ADDRESS, (uint32_t)unparkAngle, 2);
 			#endif
     	    if(shutterStatus == UNPARKED || shutterStatus == UNPARKING) {
-				servo.move(unparkAngle);
+				moveServo(unparkAngle);
             }
-    	    sprintf(temp, "*A%03d#", unparkAngle);
-            Serial.print(temp);
+    	    snprintf(temp, sizeof(temp), "*A%03d#", unparkAngle);
+            replyPort->print(temp);
 			break;
         }
 		/*
@@ -452,8 +961,8 @@ void flatcapCommand(char* command) {
     	xxx = current brightness from 000-255
         */
         case 'J': {
-            sprintf(temp, "*J%03d#", brightness);
-            Serial.print(temp);
+            snprintf(temp, sizeof(temp), "*J%03d#", brightness);
+            replyPort->print(temp);
 			break;
         }
 		/*
@@ -463,8 +972,8 @@ void flatcapCommand(char* command) {
     	xxx = current park angle from 000-360
         */
         case 'K': {
-            sprintf(temp, "*K%03d#", parkAngle);
-            Serial.print(temp);
+            snprintf(temp, sizeof(temp), "*K%03d#", parkAngle);
+            replyPort->print(temp);
 			break;
         }
 		/*
@@ -474,8 +983,82 @@ void flatcapCommand(char* command) {
     	xxx = current unpark angle from 000-360
         */
         case 'H': {
-            sprintf(temp, "*H%03d#", unparkAngle);
-            Serial.print(temp);
+            snprintf(temp, sizeof(temp), "*H%03d#", unparkAngle);
+            replyPort->print(temp);
+			break;
+        }
+		/*
+    	Set servo speed
+    	Request: >Wxxx#
+    	xxx = cruise speed in deg/s from 001-600
+    	Return : *Wxxx#
+        */
+        case 'W': {
+			uint16_t value = atoi(data);
+			if(value > 0 && value <= SERVO_MAX_SPEED) {
+				servoSpeed = value;
+				#ifndef EXTERNAL_EEPROM
+				EEPROM.put(SERVO_SPEED_ADDRESS, servoSpeed);
+				EEPROM.commit();
+				#else
+				eepromWriteLong(SERVO_SPEED_ADDRESS, (uint32_t)servoSpeed, 2);
+				#endif
+			}
+    	    snprintf(temp, sizeof(temp), "*W%03d#", servoSpeed);
+            replyPort->print(temp);
+			break;
+        }
+		/*
+    	Set servo acceleration
+    	Request: >Xxxx#
+    	xxx = acceleration and deceleration in deg/s^2 from 001-999
+    	Return : *Xxxx#
+        */
+        case 'X': {
+			uint16_t value = atoi(data);
+			if(value > 0 && value <= SERVO_MAX_ACCELERATION) {
+				servoAcceleration = value;
+				#ifndef EXTERNAL_EEPROM
+				EEPROM.put(SERVO_ACCELERATION_ADDRESS, servoAcceleration);
+				EEPROM.commit();
+				#else
+				eepromWriteLong(SERVO_ACCELERATION_ADDRESS, (uint32_t)servoAcceleration, 2);
+				#endif
+			}
+    	    snprintf(temp, sizeof(temp), "*X%03d#", servoAcceleration);
+            replyPort->print(temp);
+			break;
+        }
+		/*
+    	Get servo speed
+    	Request: >Y000#
+    	Return : *Yxxx#
+        */
+        case 'Y': {
+            snprintf(temp, sizeof(temp), "*Y%03d#", servoSpeed);
+            replyPort->print(temp);
+			break;
+        }
+		/*
+    	Get servo acceleration
+    	Request: >U000#
+    	Return : *Uxxx#
+        */
+        case 'U': {
+            snprintf(temp, sizeof(temp), "*U%03d#", servoAcceleration);
+            replyPort->print(temp);
+			break;
+        }
+		/*
+    	Get unit ID, the factory MAC of the ESP32, so the driver can tell units apart
+    	Request: >I000#
+    	Return : *Ixxxxxxxxxxxx#
+    	xxxxxxxxxxxx = 48 bit ID in hex
+        */
+        case 'I': {
+			char id[16];
+            snprintf(id, sizeof(id), "*I%012llx#", (unsigned long long)ESP.getEfuseMac());
+            replyPort->print(id);
 			break;
         }
         /*
@@ -484,12 +1067,266 @@ void flatcapCommand(char* command) {
     	Return : *V001#
         */
         case 'V': {
-            Serial.print("*V002#");
+            replyPort->print("*V009#");
 			break;
         }
     }
 }
 
+void applyCurrents() {
+	TMCdriver.rms_current(runCurrent, holdPercent / 100.0f);
+	TMCdriver.iholddelay(holdDelay);
+	TMCdriver.TPOWERDOWN(powerDown);
+}
+
+void saveCurrents() {
+	applyCurrents();
+	#ifndef EXTERNAL_EEPROM
+	EEPROM.put(RUN_CURRENT_ADDRESS, runCurrent);
+	EEPROM.update(HOLD_PERCENT_ADDRESS, holdPercent);
+	EEPROM.update(HOLD_DELAY_ADDRESS, holdDelay);
+	EEPROM.update(POWER_DOWN_ADDRESS, powerDown);
+	EEPROM.update(IDLE_MODE_ADDRESS, idleMode);
+	EEPROM.commit();
+	#else
+	eepromWriteLong(RUN_CURRENT_ADDRESS, (uint32_t)runCurrent, 2);
+	eepromWriteByte(HOLD_PERCENT_ADDRESS, holdPercent, false);
+	eepromWriteByte(HOLD_DELAY_ADDRESS, holdDelay, false);
+	eepromWriteByte(POWER_DOWN_ADDRESS, powerDown, false);
+	eepromWriteByte(IDLE_MODE_ADDRESS, idleMode, false);
+	#endif
+}
+
+/*
+Compares the steps issued by stepper.run() with what the encoder saw. A jammed or slipping motor
+keeps getting steps while the encoder stands still, so the move is aborted as soon as the lag
+exceeds SLIP_STEPS instead of running forever.
+*/
+void checkStall() {
+	if(stepper.distanceToGo() == 0) {
+		stepsSinceProgress = 0;
+		progressPosition = stepper.currentPosition;
+		return;
+	}
+	int32_t moved = abs(stepper.currentPosition - progressPosition);
+	if(moved > 0) {
+		progressPosition = stepper.currentPosition;
+		stepsSinceProgress = max((int32_t)0, stepsSinceProgress - moved);
+	}
+	if(encoderError) {
+		abortMove(FAULT_ENCODER);
+	} else if(stepsSinceProgress > SLIP_STEPS) {
+		abortMove(FAULT_SLIP);
+	}
+	#ifdef USE_STALLGUARD
+	else if(millis() - millisLastStallCheck >= STALL_INTERVAL) {
+		millisLastStallCheck = millis();
+		if(fabs(stepper.speed()) >= STALL_MIN_SPEED && TMCdriver.SG_RESULT() < 2 * STALL_THRESHOLD) {
+			abortMove(FAULT_STALL);
+		}
+	}
+	#endif
+}
+
+void abortMove(uint8_t reason) {
+	// Running into the stop is the point of a homing approach
+	if((homeState == HOME_FAST || homeState == HOME_SLOW) && (reason == FAULT_SLIP || reason == FAULT_STALL)) {
+		homeStopReached();
+		return;
+	}
+	stopMove();
+	fault = reason;
+}
+
+void startMove(int32_t target) {
+	approachPending = false;		// a new move replaces the rest of a sequence step
+	if(!isEnabled) {				// with IDLE_HOLD the coils are still energised, nothing to do
+		stepper.enableOutputs();
+		isEnabled = true;
+	}
+	movingAllowed = true;
+	clearFault();
+	stepper.moveTo(target);
+}
+
+// Motor position of a position in the driver's coordinates, kept inside what the stepper can represent
+int32_t motorPosition(int64_t position) {
+	return (int32_t)constrain(position - stepperOffset, (int64_t)INT32_MIN, (int64_t)INT32_MAX);
+}
+
+// Position in the driver's coordinates as sent in replies, wrapping like the protocol's 32 bit hex
+uint32_t driverPosition(int32_t position) {
+	return (uint32_t)((int64_t)position + stepperOffset);
+}
+
+void stopMove() {
+	endHoming(NO_FAULT);
+	approachPending = false;
+	stepper.stop();
+	if(idleMode == IDLE_DISABLE) {	// IDLE_HOLD keeps the torque, the driver drops to IHOLD on its own
+		stepper.disableOutputs();
+		isEnabled = false;
+	}
+	movingAllowed = false;
+	timedMove = false;
+}
+
+/*
+Sensorless homing: approach the inner stop fast until StallGuard or the encoder sees the motor
+stall, back off, touch it again slowly and make where the encoder says the motor stopped
+position 0. runHoming() steps through the phases from loop(), commands are answered meanwhile.
+Without USE_STALLGUARD the fast touch is detected by the encoder too, a few steps later.
+*/
+void startHoming() {
+	timedMove = false;
+	stepper.setMaxSpeed(HOME_FAST_SPEED);
+	stepper.setAcceleration(HOME_ACCELERATION);
+	homeState = HOME_FAST;
+	startMove((int32_t)max((int64_t)stepper.currentPosition - maxPosition - HOME_TRAVEL_MARGIN, (int64_t)INT32_MIN));
+}
+
+void runHoming() {
+	if(movingAllowed && stepper.isRunning()) {
+		return;
+	}
+	switch(homeState) {
+		case HOME_FAST:
+		case HOME_SLOW:
+			endHoming(FAULT_HOME);			// the whole travel without a stop
+			stopMove();
+			break;
+		case HOME_BACKOFF:
+			stepper.setMaxSpeed(HOME_SLOW_SPEED);
+			homeState = HOME_SLOW;
+			startMove(stepper.currentPosition - 2 * HOME_BACKOFF_STEPS);
+			break;
+		case HOME_CLEAR:
+			endHoming(NO_FAULT);
+			break;
+	}
+}
+
+void homeStopReached() {
+	stepper.setCurrentPosition(stepper.currentPosition);		// pressed against the stop, no deceleration ramp
+	if(homeState == HOME_FAST) {
+		homeState = HOME_BACKOFF;
+		startMove(stepper.currentPosition + HOME_BACKOFF_STEPS);
+	} else {
+		// Motor and encoder are zeroed rather than offset, after a power loss the motor can be further out
+		// than the 16 bit offset reaches. currentPosition comes from the encoder, skipped steps don't shift the zero
+		encoderPosition -= (int32_t)lround(stepper.currentPosition * ENCODER_MOTOR_RATIO);
+		stepper.setCurrentPosition(0);
+		stepperOffset = 0;
+		lastSavedPosition = UINT32_MAX;		// the zero moved, save even if the position reads the same
+		homeState = HOME_CLEAR;
+		startMove(stepper.currentPosition + HOME_CLEARANCE_STEPS);
+	}
+}
+
+void endHoming(uint8_t result) {
+	if(homeState == HOME_IDLE) {
+		return;
+	}
+	homeState = HOME_IDLE;
+	stepper.setMaxSpeed(STEPPER_SPEED);
+	stepper.setAcceleration(STEPPER_ACCELERATION);
+	fault = result;
+}
+
+/*
+Focus sequence: the driver uploads the targets of an autofocus sweep once, then each :QN# (or a
+trigger edge) starts the next one. Targets on the wrong side of the motor for sequenceBacklash are
+overshot and approached again from the right side, in one step, so every sample sees the same
+backlash. Returns the index of the step started, -1 at the end of the sequence.
+*/
+int16_t nextSequenceStep() {
+	if(sequenceNext >= sequenceLength) {
+		return -1;
+	}
+	int32_t target = motorPosition(sequence[sequenceNext]);
+	int32_t distance = target - stepper.currentPosition;
+	timedMove = false;
+	endHoming(NO_FAULT);
+	if(sequenceBacklash != 0 && distance != 0 && (distance > 0) != (sequenceBacklash > 0)) {
+		startMove(target - sequenceBacklash);
+		approachTarget = target;
+		approachPending = true;
+	} else {
+		startMove(target);
+	}
+	return sequenceNext++;
+}
+
+void runApproach() {
+	if(movingAllowed && stepper.isRunning()) {
+		return;
+	}
+	startMove(approachTarget);			// an aborted overshoot never gets here, stopMove() cancels the step
+}
+
+bool isMoving() {
+	return (stepper.isRunning() && movingAllowed) || homeState != HOME_IDLE || approachPending;
+}
+
+void clearFault() {
+	fault = NO_FAULT;
+	encoderError = false;
+	stepsSinceProgress = 0;
+	progressPosition = stepper.currentPosition;
+}
+
+/*
+Starts a trapezoidal move from the current servo angle: accelerate at servoAcceleration, cruise at
+servoSpeed and decelerate into the goal. Short moves never reach cruise speed and become triangular.
+A move started while another one is running continues from the current angle.
+*/
+void moveServo(uint16_t angle) {
+	servoStart = servoAngle;
+	servoDistance = (float)angle - servoAngle;
+	float distance = fabs(servoDistance);
+	float speed = servoSpeed;
+	float acceleration = servoAcceleration;
+	if(distance < speed * speed / acceleration) {
+		servoPeak = sqrt(distance * acceleration);
+		servoAccelTime = servoPeak / acceleration;
+		servoCruiseTime = 0;
+	} else {
+		servoPeak = speed;
+		servoAccelTime = speed / acceleration;
+		servoCruiseTime = (distance - speed * speed / acceleration) / speed;
+	}
+	millisServoStart = millis();
+	servoRunning = distance > 0;
+}
+
+void runServo() {
+	if(!servoRunning) {
+		return;
+	}
+	float t = (millis() - millisServoStart) / 1000.0f;
+	float distance = fabs(servoDistance);
+	float acceleration = servoAcceleration;
+	float total = 2 * servoAccelTime + servoCruiseTime;
+	float travelled;
+	if(t < servoAccelTime) {
+		travelled = 0.5f * acceleration * t * t;
+	} else if(t < servoAccelTime + servoCruiseTime) {
+		travelled = 0.5f * servoPeak * servoAccelTime + servoPeak * (t - servoAccelTime);
+	} else if(t < total) {
+		float remaining = total - t;
+		travelled = distance - 0.5f * acceleration * remaining * remaining;
+	} else {
+		travelled = distance;
+		servoRunning = false;
+	}
+	servoAngle = servoStart + ((servoDistance < 0) ? -travelled : travelled);
+	int angle = (int)(servoAngle + 0.5f);
+	if(angle != lastServoWrite) {			// only touch the PWM when the output actually changes
+		servo.write(angle);
+		lastServoWrite = angle;
+	}
+}
+
 void setShutter(int shutter) {
 	if(shutter != PARKED && shutter != UNPARKED) {
 		return;
@@ -498,10 +1335,10 @@ void setShutter(int shutter) {
 		ledcWrite(LED, 0);
 		lightStatus = OFF;
 		shutterStatus = PARKING;
-		servo.move(parkAngle);
+		moveServo(parkAngle);
 	} else if(shutter == UNPARKED) {
 		shutterStatus = UNPARKING;
-		servo.move(unparkAngle);
+		moveServo(unparkAngle);
 	}
 	#ifndef EXTERNAL_EEPROM
 	EEPROM.update(SHUTTER_STATUS_ADDRESS, shutter);
@@ -511,6 +1348,21 @@ void setShutter(int shutter) {
 	#endif
 }
 
+void setBrightness(uint8_t value) {
+	if(value != brightness) {			// >F sends it every time, don't wear the EEPROM or block for the write
+		brightness = value;
+		#ifndef EXTERNAL_EEPROM
+		EEPROM.update(BRIGHTNESS_ADDRESS, brightness);
+		EEPROM.commit();
+		#else
+		eepromWriteByte(BRIGHTNESS_ADDRESS, (byte)brightness, false);
+		#endif
+	}
+	if(lightStatus == ON && shutterStatus == PARKED) {
+		ledcWrite(LED, brightness);
+	}
+}
+
 uint32_t hexStringToLong(String str) {
 	char buffer[str.length() + 1];
   	str.toCharArray(buffer, str.length() + 1);
@@ -535,9 +1387,10 @@ int readEncoderCounts() {
 
 int32_t getEncoderPosition() {
 	int newCount = readEncoderCounts();
-    for(int i = 0; i < 3 && newCount > COUNTS_PER_REVOLUTION || newCount < 0; i++, newCount = readEncoderCounts()) {}		// try four times
+    for(int i = 0; i < 3 && (newCount > COUNTS_PER_REVOLUTION || newCount < 0); i++, newCount = readEncoderCounts()) {}		// try four times
     if(newCount < 0 || newCount > COUNTS_PER_REVOLUTION) {
-        return 0;
+		encoderError = true;
+        return encoderPosition;			// keep the last known position rather than jumping to 0
     }
     int delta = newCount - counts;
     if(delta > (COUNTS_PER_REVOLUTION >> 1)) {
@@ -550,6 +1403,27 @@ int32_t getEncoderPosition() {
 	return encoderPosition;
 }
 
+/*
+The encoder is absolute within one turn only, so the saved position supplies the turn and the
+encoder the angle. Without this the first read after a reboot counted from 0 and the saved position was lost.
+*/
+void restoreEncoderPosition(int32_t position) {
+	int32_t saved = (int32_t)lround(position * ENCODER_MOTOR_RATIO);
+	int expected = ((saved % COUNTS_PER_REVOLUTION) + COUNTS_PER_REVOLUTION) % COUNTS_PER_REVOLUTION;
+	int newCount = readEncoderCounts();
+	if(newCount < 0 || newCount > COUNTS_PER_REVOLUTION) {
+		newCount = expected;			// the first good read in loop() adds whatever moved since
+	}
+	int delta = newCount - expected;
+	if(delta > (COUNTS_PER_REVOLUTION >> 1)) {
+		delta -= COUNTS_PER_REVOLUTION;
+	} else if(delta < -(COUNTS_PER_REVOLUTION >> 1)) {
+		delta += COUNTS_PER_REVOLUTION;
+	}
+	counts = newCount;
+	encoderPosition = saved + delta;
+}
+
 #ifdef EXTERNAL_EEPROM
 
 void eepromWriteLong(uint16_t address, uint32_t data, int length) {
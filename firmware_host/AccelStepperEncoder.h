@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Arduino.h"
+
+/*
+AccelStepper with the position members public, like the library the firmware is built with.
+Speed follows a constant acceleration ramp on the host clock and every step turns host::shaft,
+unless host::slipping is set or the shaft is at host::innerStop.
+*/
+class AccelStepperEncoder
+{
+    public:
+        enum MotorInterfaceType
+        {
+            DRIVER = 1
+        };
+
+        AccelStepperEncoder(uint8_t interface = DRIVER, uint8_t pin1 = 2, uint8_t pin2 = 3) {}
+
+        void setMaxSpeed(float speed) { maxSpeed = speed; }
+        void setAcceleration(float value) { acceleration = value; }
+        void setPinsInverted(bool, bool, bool) {}
+        void setEnablePin(uint8_t) {}
+        void enableOutputs() { enabled = true; }
+        void disableOutputs() { enabled = false; }
+
+        void moveTo(long position) { targetPosition = position; }
+        void setCurrentPosition(long position)
+        {
+            currentPosition = targetPosition = position;
+            currentSpeed = 0;
+            fraction = 0;
+        }
+        long distanceToGo() const { return targetPosition - currentPosition; }
+        float speed() const { return currentSpeed; }
+        bool isRunning() const { return currentSpeed != 0 || distanceToGo() != 0; }
+
+        void stop();
+        bool run();
+
+        int32_t currentPosition { 0 };
+        int32_t targetPosition { 0 };
+
+    private:
+        float maxSpeed { 1 };
+        float acceleration { 1 };
+        float currentSpeed { 0 };
+        double fraction { 0 };
+        uint64_t lastRun { 0 };
+        bool enabled { false };
+};
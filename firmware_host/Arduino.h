@@ -0,0 +1,143 @@
+#pragma once
+
+/*
+Just enough of the Arduino core for esp32.ino to build on Linux. Hardware is simulated in the
+host namespace: a virtual clock, in-memory serial ports, the LED PWM duty and the motor shaft
+the encoder reads.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+
+#define OUTPUT 0x03
+#define INPUT 0x01
+#define HIGH 0x1
+#define LOW 0x0
+#define SERIAL_8N1 0x800001c
+
+namespace host
+{
+    // Virtual time in microseconds, delay() advances it without sleeping
+    uint64_t now();
+    void advance(uint64_t us);
+
+    // Simulated hardware
+    extern double shaft;                // motor shaft position in full steps
+    extern double encoderRatio;         // encoder counts per step
+    extern bool encoderFault;           // encoder stops answering on I2C
+    extern bool slipping;               // steps are issued but the shaft doesn't turn
+    extern double innerStop;            // hard stop the shaft can't turn below
+    extern int ledDuty;
+    extern uint8_t eeprom[8192];        // M24C64 contents, blank is 0xFF
+
+    int encoderCounts();
+}
+
+template <typename T>
+T constrain(T value, T low, T high)
+{
+    return value < low ? low : (value > high ? high : value);
+}
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+bool ledcAttach(uint8_t pin, uint32_t frequency, uint8_t resolution);
+bool ledcWrite(uint8_t pin, uint32_t duty);
+
+class String
+{
+    public:
+        String() = default;
+        String(const char *text) : text(text) {}
+
+        unsigned int length() const { return text.size(); }
+        String substring(unsigned int from) const { return from < text.size() ? text.substr(from).c_str() : ""; }
+        String substring(unsigned int from, unsigned int to) const
+        {
+            return from < text.size() ? text.substr(from, to - from).c_str() : "";
+        }
+        bool equals(const char *other) const { return text == other; }
+        bool startsWith(const char *prefix) const { return text.compare(0, strlen(prefix), prefix) == 0; }
+        void toCharArray(char *buffer, unsigned int size) const
+        {
+            if (size == 0)
+                return;
+            size_t n = std::min<size_t>(size - 1, text.size());
+            memcpy(buffer, text.data(), n);
+            buffer[n] = '\0';
+        }
+        const char *c_str() const { return text.c_str(); }
+
+    private:
+        std::string text;
+};
+
+class Stream
+{
+    public:
+        virtual ~Stream() = default;
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual size_t print(const char *text) = 0;
+};
+
+// Serial port backed by two strings, feed() what the host sends and take() what the firmware printed
+class HardwareSerial : public Stream
+{
+    public:
+        void begin(unsigned long, uint32_t = SERIAL_8N1, int8_t = -1, int8_t = -1) {}
+        explicit operator bool() const { return true; }
+
+        int available() override { return input.size() - position; }
+        int read() override { return position < input.size() ? static_cast<unsigned char>(input[position++]) : -1; }
+        size_t print(const char *text) override
+        {
+            output += text;
+            return strlen(text);
+        }
+
+        void feed(const std::string &text)
+        {
+            input.erase(0, position);
+            position = 0;
+            input += text;
+        }
+        std::string take()
+        {
+            std::string text;
+            text.swap(output);
+            return text;
+        }
+
+    private:
+        std::string input, output;
+        size_t position { 0 };
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial2;
+
+class EspClass
+{
+    public:
+        uint32_t getCycleCount();               // runs at getCpuFreqMHz() on the host clock
+        uint32_t getCpuFreqMHz() { return 240; }
+        uint64_t getEfuseMac() { return 0xf0ca9ULL; }
+};
+
+extern EspClass ESP;
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "OneWire.h"
+
+class DallasTemperature
+{
+    public:
+        explicit DallasTemperature(OneWire *wire) {}
+
+        void begin() {}
+        void requestTemperatures() {}
+        float getTempByIndex(uint8_t index) { return temperature; }
+
+        float temperature { 20.0f };
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "Arduino.h"
+
+class ESPServo
+{
+    public:
+        void attach(int pin, int minAngle, int maxAngle) {}
+        void sync(float angle) { this->angle = angle; }
+        void write(int angle)
+        {
+            this->angle = angle;
+            writes++;
+        }
+
+        float angle { 0 };
+        uint32_t writes { 0 };
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Arduino.h"
+
+// Keeps the register values the firmware sets, SG_RESULT reads as a freely turning motor
+class TMC2209Stepper
+{
+    public:
+        TMC2209Stepper(Stream *serial, float rSense, uint8_t address) {}
+
+        void begin() {}
+        void toff(uint8_t value) { offTime = value; }
+        void rms_current(uint16_t mA, float holdMultiplier)
+        {
+            runCurrent = mA;
+            holdCurrent = mA * holdMultiplier;
+        }
+        void iholddelay(uint8_t value) { holdDelay = value; }
+        void TPOWERDOWN(uint8_t value) { powerDown = value; }
+        void microsteps(uint16_t value) { microstepping = value; }
+        void en_spreadCycle(bool value) { spreadCycle = value; }
+        void pwm_autoscale(bool) {}
+        void SGTHRS(uint8_t value) { stallThreshold = value; }
+        void TCOOLTHRS(uint32_t) {}
+        void I_scale_analog(bool) {}
+        void pdn_disable(bool) {}
+        uint16_t SG_RESULT() { return stallGuardResult; }
+
+        uint8_t offTime { 0 }, holdDelay { 0 }, powerDown { 0 }, stallThreshold { 0 };
+        uint16_t runCurrent { 0 }, microstepping { 0 }, stallGuardResult { 500 };
+        float holdCurrent { 0 };
+        bool spreadCycle { false };
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "Arduino.h"
+
+// No network on the host, the server never accepts a client
+#define WIFI_STA 1
+
+class WiFiClient : public Stream
+{
+    public:
+        explicit operator bool() const { return false; }
+        bool connected() { return false; }
+        void stop() {}
+        int setNoDelay(bool) { return 0; }
+
+        int available() override { return 0; }
+        int read() override { return -1; }
+        size_t print(const char *text) override { return 0; }
+};
+
+class WiFiServer
+{
+    public:
+        explicit WiFiServer(uint16_t port) {}
+
+        void begin() {}
+        void setNoDelay(bool) {}
+        WiFiClient accept() { return WiFiClient(); }
+};
+
+class WiFiClass
+{
+    public:
+        bool mode(int) { return true; }
+        bool setSleep(bool) { return true; }
+        bool setHostname(const char *) { return true; }
+        int begin(const char *ssid, const char *password) { return 0; }
+};
+
+extern WiFiClass WiFi;
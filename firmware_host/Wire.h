@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Arduino.h"
+
+#include <vector>
+
+/*
+I2C bus with the two devices on the Focap board: the M24C64 EEPROM at 0x50 and the encoder at
+0x06, whose angle registers 0x03/0x04 follow host::shaft.
+*/
+class TwoWire
+{
+    public:
+        bool begin(int sda = -1, int scl = -1, uint32_t frequency = 0);
+        void setClock(uint32_t frequency) {}
+
+        void beginTransmission(int address);
+        size_t write(uint8_t data);
+        uint8_t endTransmission(bool sendStop = true);
+        uint8_t requestFrom(int address, int quantity);
+        int available();
+        int read();
+
+    private:
+        int device { -1 };
+        std::vector<uint8_t> transmit;
+        std::vector<uint8_t> receive;
+        size_t receivePosition { 0 };
+        uint16_t eepromPointer { 0 };
+        uint8_t encoderRegister { 0 };
+};
+
+extern TwoWire Wire;
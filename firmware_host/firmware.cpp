@@ -0,0 +1,3 @@
+// esp32.ino as an ordinary translation unit, built against the shims in this directory
+#include "Arduino.h"
+#include "../esp32.ino"
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "Arduino.h"
+
+// Entry points of esp32.ino for host programs linking the focap_firmware library
+void setup();
+void loop();
+void readCommand(Stream& port);
+int32_t getEncoderPosition();
+void eepromWriteLong(uint16_t address, uint32_t data, int length);
+uint32_t eepromReadLong(uint16_t address, int length);
@@ -0,0 +1,218 @@
+#include "Arduino.h"
+#include "Wire.h"
+#include "WiFi.h"
+#include "ESPmDNS.h"
+#include "AccelStepperEncoder.h"
+
+#include <chrono>
+
+HardwareSerial Serial;
+HardwareSerial Serial2;
+TwoWire Wire;
+WiFiClass WiFi;
+MDNSResponder MDNS;
+EspClass ESP;
+
+#define ENCODER_COUNTS (1 << 14)
+#define ENCODER_I2C_ADDRESS 0x06
+#define EEPROM_I2C_ADDRESS 0x50
+
+namespace host
+{
+    double shaft = 0;
+    double encoderRatio = 30.4;
+    bool encoderFault = false;
+    bool slipping = false;
+    double innerStop = -1e12;
+    int ledDuty = 0;
+    uint8_t eeprom[8192];
+
+    static const auto start = std::chrono::steady_clock::now();
+    static uint64_t skipped = 0;
+
+    static const bool blank = []
+    {
+        memset(eeprom, 0xFF, sizeof(eeprom));
+        return true;
+    }();
+
+    uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() + skipped;
+    }
+
+    void advance(uint64_t us)
+    {
+        skipped += us;
+    }
+
+    int encoderCounts()
+    {
+        long counts = lround(shaft * encoderRatio) % ENCODER_COUNTS;
+        return counts < 0 ? counts + ENCODER_COUNTS : counts;
+    }
+}
+
+uint32_t millis()
+{
+    return host::now() / 1000;
+}
+
+uint32_t micros()
+{
+    return host::now();
+}
+
+void delay(uint32_t ms)
+{
+    host::advance(ms * 1000ULL);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    host::advance(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) {}
+
+bool ledcAttach(uint8_t pin, uint32_t frequency, uint8_t resolution)
+{
+    return true;
+}
+
+bool ledcWrite(uint8_t pin, uint32_t duty)
+{
+    host::ledDuty = duty;
+    return true;
+}
+
+uint32_t EspClass::getCycleCount()
+{
+    // Real time, not virtual, so the firmware's loop profiler measures what the host spends
+    static const auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    return static_cast<uint32_t>(elapsed * getCpuFreqMHz() / 1000);
+}
+
+bool TwoWire::begin(int sda, int scl, uint32_t frequency)
+{
+    return true;
+}
+
+void TwoWire::beginTransmission(int address)
+{
+    device = address;
+    transmit.clear();
+}
+
+size_t TwoWire::write(uint8_t data)
+{
+    transmit.push_back(data);
+    return 1;
+}
+
+uint8_t TwoWire::endTransmission(bool sendStop)
+{
+    if (device == EEPROM_I2C_ADDRESS && transmit.size() >= 2)
+    {
+        eepromPointer = ((transmit[0] << 8) | transmit[1]) % sizeof(host::eeprom);
+        for (size_t i = 2; i < transmit.size(); i++)
+        {
+            host::eeprom[eepromPointer] = transmit[i];
+            eepromPointer = (eepromPointer + 1) % sizeof(host::eeprom);
+        }
+        return 0;
+    }
+    if (device == ENCODER_I2C_ADDRESS && !transmit.empty() && !host::encoderFault)
+    {
+        encoderRegister = transmit[0];
+        return 0;
+    }
+    return 2;           // address NACK
+}
+
+uint8_t TwoWire::requestFrom(int address, int quantity)
+{
+    receive.clear();
+    receivePosition = 0;
+
+    if (address == EEPROM_I2C_ADDRESS)
+    {
+        for (int i = 0; i < quantity; i++)
+        {
+            receive.push_back(host::eeprom[eepromPointer]);
+            eepromPointer = (eepromPointer + 1) % sizeof(host::eeprom);
+        }
+    }
+    else if (address == ENCODER_I2C_ADDRESS && !host::encoderFault)
+    {
+        // 14 bit angle, high byte in 0x03, low six bits in the top of 0x04
+        int counts = host::encoderCounts();
+        uint8_t registers[2] = { static_cast<uint8_t>(counts >> 6), static_cast<uint8_t>((counts & 0x3F) << 2) };
+        for (int i = 0; i < quantity; i++)
+        {
+            int index = encoderRegister - 0x03 + i;
+            receive.push_back(index >= 0 && index < 2 ? registers[index] : 0);
+        }
+    }
+    return receive.size();
+}
+
+int TwoWire::available()
+{
+    return receive.size() - receivePosition;
+}
+
+int TwoWire::read()
+{
+    return receivePosition < receive.size() ? receive[receivePosition++] : -1;
+}
+
+void AccelStepperEncoder::stop()
+{
+    if (currentSpeed == 0)
+        return;
+    long stoppingDistance = static_cast<long>(currentSpeed * currentSpeed / (2 * acceleration)) + 1;
+    targetPosition = currentPosition + (currentSpeed > 0 ? stoppingDistance : -stoppingDistance);
+}
+
+bool AccelStepperEncoder::run()
+{
+    uint64_t now = host::now();
+    double dt = (lastRun && currentSpeed != 0) ? (now - lastRun) / 1e6 : 0;
+    lastRun = now;
+
+    long distance = distanceToGo();
+    if (distance == 0 && std::fabs(currentSpeed) * std::fabs(currentSpeed) < 2 * acceleration)
+    {
+        currentSpeed = 0;
+        fraction = 0;
+        return false;
+    }
+
+    // Accelerate towards the target until the remaining distance is the braking distance
+    int direction = (distance > 0) - (distance < 0);
+    float braking = currentSpeed * currentSpeed / (2 * acceleration);
+    if (direction != 0 && (currentSpeed * direction < 0 || braking < std::labs(distance)))
+        currentSpeed += direction * acceleration * dt;
+    else if (currentSpeed != 0)
+        currentSpeed -= (currentSpeed > 0 ? 1 : -1) * std::min<float>(std::fabs(currentSpeed), acceleration * dt);
+    currentSpeed = std::max(-maxSpeed, std::min(maxSpeed, currentSpeed));
+
+    // A stopped motor needs a first step to get going, AccelStepper starts at sqrt(2 * acceleration)
+    if (currentSpeed == 0 && direction != 0)
+        currentSpeed = direction * std::min<float>(maxSpeed, std::sqrt(2 * acceleration));
+
+    // Like AccelStepper, at most one step per call however long the loop took
+    fraction += currentSpeed * dt;
+    if (std::fabs(fraction) >= 1)
+    {
+        int step = fraction > 0 ? 1 : -1;
+        fraction = std::fmod(fraction - step, 1.0);
+        currentPosition += step;
+        if (enabled && !host::slipping && host::shaft + step >= host::innerStop)
+            host::shaft += step;
+    }
+    return true;
+}
@@ -0,0 +1,3 @@
+// The host build never joins a network, see wifi_credentials.example.h for the real one
+#define WIFI_SSID "host"
+#define WIFI_PASSWORD ""
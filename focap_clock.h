@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <stdint.h>
+
+/*
+Maps the firmware's micros() onto the host clock. Every :GU# exchange gives the device time
+somewhere between sending and receiving, so host minus device is known to half the round trip.
+Offsets are fitted against device time over the last exchanges, the slope is the drift of the
+ESP32's crystal. Exchanges that took much longer than the best recent one, a busy loop or a USB
+hiccup, are left out of the fit.
+*/
+class ClockSync
+{
+    public:
+        // sent and received are host times in seconds around one exchange, deviceMicros its reply
+        void addExchange(double sent, double received, uint32_t deviceMicros)
+        {
+            double device = unwrap(deviceMicros);
+            double roundTrip = received - sent;
+            exchanges.push_back({ device, (sent + received) / 2 - device, roundTrip });
+            if (exchanges.size() > MAX_EXCHANGES)
+                exchanges.pop_front();
+            fit();
+        }
+
+        // Host time of a device timestamp, only meaningful once isValid()
+        double toHost(uint32_t deviceMicros)
+        {
+            double device = unwrap(deviceMicros);
+            return device + offset + drift * (device - reference);
+        }
+
+        bool isValid() const
+        {
+            return !exchanges.empty();
+        }
+
+        void reset()
+        {
+            exchanges.clear();
+            hasLast = false;
+            offset = drift = reference = 0;
+            uncertainty = 0;
+        }
+
+        // Host minus device in seconds, at the newest exchange
+        double currentOffset() const
+        {
+            return exchanges.empty() ? 0 : offset + drift * (exchanges.back().device - reference);
+        }
+
+        // Device clock error in parts per million, positive when it runs slow
+        double driftPpm() const
+        {
+            return drift * 1e6;
+        }
+
+        // Half the best round trip in the window, in seconds
+        double error() const
+        {
+            return uncertainty;
+        }
+
+    private:
+        struct Exchange
+        {
+            double device;          // s, unwrapped
+            double offset;          // s, host minus device
+            double roundTrip;       // s
+        };
+
+        // micros() wraps every 71 minutes, replies are never that far apart
+        double unwrap(uint32_t deviceMicros)
+        {
+            if (!hasLast)
+            {
+                extended = deviceMicros;
+                hasLast = true;
+            }
+            else
+                extended += static_cast<int32_t>(deviceMicros - last);
+            last = deviceMicros;
+            return extended / 1e6;
+        }
+
+        void fit()
+        {
+            double best = exchanges.front().roundTrip;
+            for (const auto &exchange : exchanges)
+                best = std::min(best, exchange.roundTrip);
+            uncertainty = best / 2;
+
+            // Least squares of offset over device time, on the exchanges close to the best
+            double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+            reference = exchanges.back().device;
+            for (const auto &exchange : exchanges)
+            {
+                if (exchange.roundTrip > best * ROUND_TRIP_TOLERANCE + MIN_ROUND_TRIP_SLACK)
+                    continue;
+                double x = exchange.device - reference;
+                n++;
+                sx += x;
+                sy += exchange.offset;
+                sxx += x * x;
+                sxy += x * exchange.offset;
+            }
+
+            double denominator = n * sxx - sx * sx;
+            if (n >= MIN_FIT_EXCHANGES && denominator > 0 && sxx / n - (sx / n) * (sx / n) >= MIN_FIT_SPAN * MIN_FIT_SPAN)
+            {
+                drift = (n * sxy - sx * sy) / denominator;
+                offset = (sy - drift * sx) / n;
+            }
+            else
+            {
+                drift = 0;
+                offset = sy / n;
+            }
+        }
+
+        static const size_t MAX_EXCHANGES { 64 };
+        static constexpr double ROUND_TRIP_TOLERANCE { 1.5 };
+        static constexpr double MIN_ROUND_TRIP_SLACK { 0.0005 }; // s, USB latency jitters this much anyway
+        static const int MIN_FIT_EXCHANGES { 4 };
+        static constexpr double MIN_FIT_SPAN { 30 };            // s, standard deviation of device times before drift is fitted
+
+        std::deque<Exchange> exchanges;
+        double offset { 0 }, drift { 0 }, reference { 0 }, uncertainty { 0 };
+        bool hasLast { false };
+        uint32_t last { 0 };
+        int64_t extended { 0 };
+};
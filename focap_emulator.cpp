@@ -0,0 +1,466 @@
+/*
+Gastro Focap emulator
+
+Listens on a TCP port and answers the protocol from communication.md the way esp32.ino does,
+so the driver can be exercised on Linux through its TCP connection:
+
+    ./focap_emulator 9999
+    (connect the driver to localhost:9999)
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define BUFFER_SIZE 32
+#define STEPS_PER_SECOND 200
+#define HOME_CLEARANCE_STEPS 5
+#define SEQUENCE_MAX_STEPS 32
+
+enum shutterStatuses
+{
+    PARKED,
+    UNPARKED,
+    PARKING,
+    UNPARKING
+};
+
+struct Client
+{
+    int fd;
+    char buffer[BUFFER_SIZE];
+    int length;
+    bool read;
+    bool isFocuserCommand;
+};
+
+static int32_t position = 0, target = 0, offset = 0, maxPosition = 100000;
+static double timedMoveLeft = 0;            // seconds until a :MT# move stops, 0 if none
+static int homeState = 0;                   // 0 idle, 1 approaching the stop, 4 clearing it, like the firmware's
+static std::vector<int32_t> sequence;      // focus sequence targets, driver coordinates
+static size_t sequenceNext = 0;
+static int16_t sequenceBacklash = 0;
+static bool approachPending = false;        // overshot a sequence target, the final leg is still to come
+static int32_t approachTarget = 0;
+static int16_t coefficient = 0x0180;
+static uint8_t brightness = 255, lightStatus = 0, shutterStatus = PARKED;
+static uint16_t parkAngle = 0, unparkAngle = 270;
+static uint16_t servoSpeed = 50, servoAcceleration = 100;
+static double servoAngle = 0;
+static bool temperatureCompensation = false;
+static bool timestamps = false;
+static unsigned int runCurrent = 600, holdPercent = 30, holdDelay = 4, powerDown = 20, idleMode = 0;
+
+static void reply(int fd, const char *text)
+{
+    if (write(fd, text, strlen(text)) < 0)
+        perror("write");
+}
+
+// The firmware's micros(), wrapping the same way
+static uint32_t micros()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+// Turns "value#" into "value@tttttttt#" when timestamps are on, values are sampled as they are asked for
+static void stamp(char *temp, size_t size)
+{
+    size_t length = strlen(temp);
+    if (timestamps && length > 0 && length + 9 < size)
+        snprintf(temp + length - 1, size - length + 1, "@%08x#", micros());
+}
+
+static void focuserCommand(int fd, const char *command)
+{
+    char temp[48] = {0};
+    const char *param = strlen(command) > 2 ? command + 2 : "";
+
+    if (!strncmp(command, "GP", 2))
+    {
+        snprintf(temp, sizeof(temp), "%04x#", static_cast<uint32_t>(position + offset));
+        stamp(temp, sizeof(temp));
+    }
+    else if (!strncmp(command, "GN", 2))
+        snprintf(temp, sizeof(temp), "%04x#", static_cast<uint32_t>(target + offset));
+    else if (!strncmp(command, "GM", 2))
+    {
+        snprintf(temp, sizeof(temp), "%08x%08x%04x%04x%04x#", static_cast<uint32_t>(position + offset), static_cast<uint32_t>(target + offset),
+                 static_cast<uint16_t>(static_cast<int16_t>((target > position) - (target < position)) * STEPS_PER_SECOND * 16),
+                 STEPS_PER_SECOND * 16, 0x7fff);
+        stamp(temp, sizeof(temp));
+    }
+    else if (!strncmp(command, "GL", 2))
+    {
+        // No real loop to profile, report an idle one
+        std::string profile(27 * 4, '0');
+        reply(fd, (profile + "#").c_str());
+    }
+    else if (!strncmp(command, "GT", 2))
+    {
+        snprintf(temp, sizeof(temp), "%04x#", (uint16_t)(20 * 128 + (1 << 15)));
+        stamp(temp, sizeof(temp));
+    }
+    else if (!strncmp(command, "GC", 2))
+        snprintf(temp, sizeof(temp), "%04x#", (uint16_t)coefficient);
+    else if (!strncmp(command, "SC", 2))
+        coefficient = static_cast<int16_t>(strtol(param, nullptr, 16));
+    else if (!strncmp(command, "GI", 2))
+        snprintf(temp, sizeof(temp), "%s", position != target || homeState || approachPending ? "1#" : "0#");
+    else if (!strncmp(command, "SP", 2))
+        offset = static_cast<int32_t>(strtol(param, nullptr, 16)) - position;
+    else if (!strncmp(command, "SN", 2))
+    {
+        target = static_cast<int32_t>(strtol(param, nullptr, 16)) - offset;
+        timedMoveLeft = 0;
+        homeState = 0;
+        approachPending = false;
+    }
+    else if (!strncmp(command, "MR", 2))
+    {
+        int64_t goal = static_cast<int64_t>(position) + offset + static_cast<int32_t>(strtol(param, nullptr, 16));
+        goal = std::max<int64_t>(0, std::min<int64_t>(maxPosition, goal));
+        target = static_cast<int32_t>(goal) - offset;
+        timedMoveLeft = 0;
+        homeState = 0;
+        approachPending = false;
+        snprintf(temp, sizeof(temp), "%08x#", static_cast<uint32_t>(goal));
+    }
+    else if (!strncmp(command, "MT", 2))
+    {
+        int64_t limit = static_cast<int64_t>(param[0] == '1' ? maxPosition : 0) - offset;
+        target = static_cast<int32_t>(std::max<int64_t>(INT32_MIN, std::min<int64_t>(INT32_MAX, limit)));
+        timedMoveLeft = param[0] ? strtol(param + 1, nullptr, 16) / 1000.0 : 0;
+        homeState = 0;
+        approachPending = false;
+    }
+    else if (!strncmp(command, "SL", 2))
+        maxPosition = static_cast<int32_t>(std::min<unsigned long>(strtoul(param, nullptr, 16), INT32_MAX));
+    else if (!strncmp(command, "FQ", 2))
+    {
+        target = position;
+        timedMoveLeft = 0;
+        homeState = 0;
+        approachPending = false;
+    }
+    else if (!strncmp(command, "PH", 2))
+    {
+        // The stop is at raw position 0, one touch instead of the firmware's fast and slow ones
+        target = 0;
+        timedMoveLeft = 0;
+        homeState = 1;
+        approachPending = false;
+    }
+    else if (!strncmp(command, "GZ", 2))
+        snprintf(temp, sizeof(temp), "%02x#", homeState);
+    else if (!strncmp(command, "GF", 2))
+        snprintf(temp, sizeof(temp), "00#");         // no slip, stall or missing stop to simulate
+    else if (!strncmp(command, "QC", 2))
+    {
+        sequence.clear();
+        sequenceNext = 0;
+    }
+    else if (!strncmp(command, "QA", 2))
+    {
+        if (sequence.size() < SEQUENCE_MAX_STEPS)
+            sequence.push_back(static_cast<int32_t>(strtoul(param, nullptr, 16)));
+        snprintf(temp, sizeof(temp), "%02x#", static_cast<unsigned>(sequence.size()));
+    }
+    else if (!strncmp(command, "QB", 2))
+        sequenceBacklash = static_cast<int16_t>(strtol(param, nullptr, 16));
+    else if (!strncmp(command, "QN", 2))
+    {
+        if (sequenceNext >= sequence.size())
+            snprintf(temp, sizeof(temp), "ff%08x#", static_cast<uint32_t>(target + offset));
+        else
+        {
+            // Same approach as the firmware: overshoot targets on the wrong side, then come back
+            int32_t goal = sequence[sequenceNext] - offset;
+            int32_t distance = goal - position;
+            timedMoveLeft = 0;
+            homeState = 0;
+            approachPending = sequenceBacklash != 0 && distance != 0 && (distance > 0) != (sequenceBacklash > 0);
+            approachTarget = goal;
+            target = approachPending ? goal - sequenceBacklash : goal;
+            snprintf(temp, sizeof(temp), "%02x%08x#", static_cast<unsigned>(sequenceNext), static_cast<uint32_t>(sequence[sequenceNext]));
+            sequenceNext++;
+        }
+    }
+    else if (!strncmp(command, "GQ", 2))
+        snprintf(temp, sizeof(temp), "%02x%02x#", static_cast<unsigned>(sequenceNext), static_cast<unsigned>(sequence.size()));
+    else if (!strncmp(command, "GH", 2))
+        snprintf(temp, sizeof(temp), "%04x%02x%02x%02x%1u#", runCurrent, holdPercent, holdDelay, powerDown, idleMode);
+    else if (!strncmp(command, "SR", 2))
+        runCurrent = strtol(param, nullptr, 16);
+    else if (!strncmp(command, "SH", 2))
+        holdPercent = strtol(param, nullptr, 16);
+    else if (!strncmp(command, "SD", 2))
+        holdDelay = strtol(param, nullptr, 16) & 0x0F;
+    else if (!strncmp(command, "SW", 2))
+        powerDown = strtol(param, nullptr, 16) & 0xFF;
+    else if (!strncmp(command, "SM", 2))
+        idleMode = param[0] == '1';
+    else if (!strncmp(command, "GU", 2))
+        snprintf(temp, sizeof(temp), "%08x#", micros());
+    else if (!strncmp(command, "TS", 2))
+        timestamps = param[0] == '1';
+    else if (!strncmp(command, "TC", 2))
+        temperatureCompensation = param[0] == '1';
+
+    if (temp[0])
+        reply(fd, temp);
+}
+
+static void flatcapCommand(int fd, const char *command)
+{
+    char temp[24] = {0};
+    int data = atoi(command + 1);
+
+    switch (*command)
+    {
+        case 'P':
+            snprintf(temp, sizeof(temp), "*P000#");
+            break;
+        case 'S':
+            snprintf(temp, sizeof(temp), "*S%1d%1d%1d%1d#", position != target || homeState || approachPending, lightStatus, shutterStatus, 0);
+            stamp(temp, sizeof(temp));
+            break;
+        case 'O':
+            shutterStatus = UNPARKING;
+            lightStatus = 0;
+            snprintf(temp, sizeof(temp), "*O000#");
+            break;
+        case 'C':
+            shutterStatus = PARKING;
+            lightStatus = 0;
+            snprintf(temp, sizeof(temp), "*C000#");
+            break;
+        case 'L':
+            if (shutterStatus == PARKED)
+                lightStatus = 1;
+            snprintf(temp, sizeof(temp), "*L000#");
+            break;
+        case 'D':
+            lightStatus = 0;
+            snprintf(temp, sizeof(temp), "*D000#");
+            break;
+        case 'B':
+            brightness = data % 256;
+            snprintf(temp, sizeof(temp), "*B%03d#", brightness);
+            break;
+        case 'F':
+            brightness = data % 256;
+            if (shutterStatus != PARKED)
+                shutterStatus = PARKING;
+            lightStatus = 2;
+            snprintf(temp, sizeof(temp), "*F%03d#", brightness);
+            break;
+        case 'E':
+            lightStatus = 0;
+            shutterStatus = UNPARKING;
+            snprintf(temp, sizeof(temp), "*E000#");
+            break;
+        case 'Z':
+            parkAngle = data % 360;
+            snprintf(temp, sizeof(temp), "*Z%03d#", parkAngle);
+            break;
+        case 'A':
+            unparkAngle = data % 360;
+            snprintf(temp, sizeof(temp), "*A%03d#", unparkAngle);
+            break;
+        case 'J':
+            snprintf(temp, sizeof(temp), "*J%03d#", brightness);
+            break;
+        case 'K':
+            snprintf(temp, sizeof(temp), "*K%03d#", parkAngle);
+            break;
+        case 'H':
+            snprintf(temp, sizeof(temp), "*H%03d#", unparkAngle);
+            break;
+        case 'I':
+            snprintf(temp, sizeof(temp), "*I%012x#", 0xf0ca9u);
+            break;
+        case 'W':
+            if (data > 0 && data <= 600)
+                servoSpeed = data;
+            snprintf(temp, sizeof(temp), "*W%03d#", servoSpeed);
+            break;
+        case 'X':
+            if (data > 0 && data <= 999)
+                servoAcceleration = data;
+            snprintf(temp, sizeof(temp), "*X%03d#", servoAcceleration);
+            break;
+        case 'Y':
+            snprintf(temp, sizeof(temp), "*Y%03d#", servoSpeed);
+            break;
+        case 'U':
+            snprintf(temp, sizeof(temp), "*U%03d#", servoAcceleration);
+            break;
+        case 'V':
+            snprintf(temp, sizeof(temp), "*V009#");
+            break;
+    }
+
+    if (temp[0])
+        reply(fd, temp);
+}
+
+// Same framing as readCommand() in the firmware, but kept per client so split packets work
+static void feed(Client &client, char c)
+{
+    switch (c)
+    {
+        case ':':
+        case '>':
+            client.isFocuserCommand = (c == ':');
+            client.read = true;
+            client.length = 0;
+            break;
+        case '#':
+            client.buffer[client.length] = '\0';
+            if (client.read && client.isFocuserCommand && client.length > 0)
+                focuserCommand(client.fd, client.buffer);
+            else if (client.read && client.length > 3)
+                flatcapCommand(client.fd, client.buffer);
+            client.read = false;
+            client.length = 0;
+            break;
+        default:
+            if (c != '\n' && client.read && client.length < BUFFER_SIZE - 2)
+                client.buffer[client.length++] = c;
+            break;
+    }
+}
+
+static void step(double seconds)
+{
+    if (timedMoveLeft > 0)
+    {
+        timedMoveLeft -= seconds;
+        if (timedMoveLeft <= 0)
+        {
+            timedMoveLeft = 0;
+            target = position;
+        }
+    }
+
+    int32_t steps = static_cast<int32_t>(seconds * STEPS_PER_SECOND + 0.5);
+    if (target > position)
+        position = std::min(target, position + steps);
+    else if (target < position)
+        position = std::max(target, position - steps);
+
+    if (approachPending && position == target)
+    {
+        target = approachTarget;
+        approachPending = false;
+    }
+
+    if (homeState == 1 && position == 0)
+    {
+        offset = 0;
+        target = HOME_CLEARANCE_STEPS;
+        homeState = 4;
+    }
+    else if (homeState == 4 && position == target)
+        homeState = 0;
+
+    if (shutterStatus == PARKING || shutterStatus == UNPARKING)
+    {
+        double goal = (shutterStatus == PARKING) ? parkAngle : unparkAngle;
+        // Cruise speed only, acceleration phases are short enough to ignore here
+        double move = seconds * servoSpeed;
+        if (std::abs(goal - servoAngle) <= move)
+        {
+            servoAngle = goal;
+            shutterStatus = (shutterStatus == PARKING) ? PARKED : UNPARKED;
+        }
+        else
+            servoAngle += (goal > servoAngle) ? move : -move;
+    }
+
+    if (lightStatus == 2 && shutterStatus == PARKED)
+        lightStatus = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int port = (argc > 1) ? atoi(argv[1]) : 9999;
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(server, 4) < 0)
+    {
+        perror("focap_emulator");
+        return 1;
+    }
+    fprintf(stderr, "Focap emulator listening on 127.0.0.1:%d\n", port);
+
+    std::vector<Client> clients;
+    auto last = std::chrono::steady_clock::now();
+
+    while (true)
+    {
+        std::vector<pollfd> fds;
+        fds.push_back({server, POLLIN, 0});
+        for (const auto &client : clients)
+            fds.push_back({client.fd, POLLIN, 0});
+
+        poll(fds.data(), fds.size(), 10);
+
+        auto now = std::chrono::steady_clock::now();
+        step(std::chrono::duration<double>(now - last).count());
+        last = now;
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(server, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                clients.push_back({fd, {0}, 0, false, false});
+            }
+        }
+
+        for (size_t i = 1; i < fds.size(); i++)
+        {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            Client &client = clients[i - 1];
+            char data[64];
+            ssize_t n = read(client.fd, data, sizeof(data));
+            if (n <= 0)
+            {
+                close(client.fd);
+                client.fd = -1;
+                continue;
+            }
+            for (ssize_t j = 0; j < n; j++)
+                feed(client, data[j]);
+        }
+
+        for (auto it = clients.begin(); it != clients.end();)
+            it = (it->fd < 0) ? clients.erase(it) : it + 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,278 @@
+/*
+Runs esp32.ino on the host against the simulated hardware in firmware_host/
+
+    focap_firmware_bench [ITERATIONS]
+
+First checks the logic that can't be watched on the board (EEPROM encoding, encoder wrap
+around, position across a reboot, a dead encoder, the flats sequence, homing, reply timestamps,
+focus sequences), then measures parser throughput and the cost of one loop() while idle and while
+moving. Times are host times, useful for comparing changes rather than as ESP32 numbers. Exits
+with 1 if a check fails.
+*/
+
+#include "focap_firmware.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+extern int16_t stepperOffset;
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    printf("%-48s %s\n", what, condition ? "ok" : "FAILED");
+    if (!condition)
+        failures++;
+}
+
+static std::string command(const char *text)
+{
+    Serial.feed(text);
+    readCommand(Serial);
+    return Serial.take();
+}
+
+static double seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Runs loop() with the virtual clock stepping 1 ms per pass until the move has ended
+static void runMove(int limit = 200000)
+{
+    for (int i = 0; i < limit && command(":GI#") != "0#"; i++)
+    {
+        loop();
+        host::advance(1000);
+    }
+}
+
+static void checkEeprom()
+{
+    const struct
+    {
+        uint16_t address;
+        uint32_t value;
+        int length;
+    } cases[] = { { 0, 0xAB, 1 }, { 1, 359, 2 }, { 6, static_cast<uint16_t>(-42), 2 }, { 8, static_cast<uint32_t>(-123456), 4 },
+        { 8, 0x7FFFFFFF, 4 } };
+
+    bool ok = true;
+    for (const auto &c : cases)
+    {
+        eepromWriteLong(c.address, c.value, c.length);
+        ok &= eepromReadLong(c.address, c.length) == c.value;
+    }
+    check(ok, "EEPROM round trip, 1/2/4 bytes");
+    check(static_cast<int16_t>(eepromReadLong(6, 2)) == -42, "EEPROM signed 16 bit offset");
+
+    // Back to a blank chip for the checks that boot the firmware
+    memset(host::eeprom, 0xFF, sizeof(host::eeprom));
+}
+
+static void checkEncoder()
+{
+    // Walk the shaft across the 14 bit wrap in both directions
+    double countsPerStep = host::encoderRatio;
+    host::shaft = (16384 - 100) / countsPerStep;
+    int32_t start = getEncoderPosition();
+    bool ok = true;
+    for (int i = 1; i <= 20; i++)
+    {
+        host::shaft += 1;
+        ok &= std::abs(getEncoderPosition() - start - lround(i * countsPerStep)) <= 1;
+    }
+    for (int i = 19; i >= -20; i--)
+    {
+        host::shaft -= 1;
+        ok &= std::abs(getEncoderPosition() - start - lround(i * countsPerStep)) <= 1;
+    }
+    check(ok, "encoder wrap around");
+
+    host::encoderFault = true;
+    int32_t last = getEncoderPosition();
+    host::encoderFault = false;
+    check(last == getEncoderPosition(), "dead encoder keeps the last position");
+}
+
+static void checkPersistence()
+{
+    host::shaft = 0;
+    setup();
+    command(":SN00000040#");
+    runMove();
+    std::string before = command(":GP#");
+
+    // The position is written DISABLE_DELAY after the move
+    for (int i = 0; i < 20; i++)
+    {
+        host::advance(1000000);
+        loop();
+    }
+
+    setup();
+    loop();
+    check(command(":GP#") == before, "position survives a reboot");
+
+    command(">B123#");
+    setup();
+    check(command(">J000#") == "*J123#", "brightness survives a reboot");
+}
+
+static void checkSlip()
+{
+    host::slipping = true;
+    command(":SN00000100#");
+    runMove(2000);
+    host::slipping = false;
+    check(command(":GF#") == "01#", "slipping motor aborts the move");
+}
+
+static void checkFlats()
+{
+    command(">O000#");
+    for (int i = 0; i < 10000 && command(">S000#")[4] != '1'; i++)
+    {
+        loop();
+        host::advance(1000);
+    }
+
+    // Status reads *SFLCE#, the light waits for the cover
+    command(">F100#");
+    bool waiting = command(">S000#")[3] == '2' && host::ledDuty == 0;
+    for (int i = 0; i < 10000 && command(">S000#")[3] == '2'; i++)
+    {
+        loop();
+        host::advance(1000);
+    }
+    check(waiting && command(">S000#").substr(3, 2) == "10" && host::ledDuty == 100, "flats: light on once the cover is parked");
+
+    command(">E000#");
+    check(command(">S000#")[3] == '0' && host::ledDuty == 0, "flats finished: light off, cover opening");
+}
+
+static void checkHoming()
+{
+    // No stop anywhere: the search ends after the travel limit instead of running for half an hour
+    command(":PH#");
+    runMove();
+    check(command(":GF#") == "04#", "homing without a stop gives up after the travel");
+
+    // Rebooted after a power loss far out in the travel, the stop 300 steps further in
+    host::shaft = 50000;
+    eepromWriteLong(8, 50000, 4);
+    eepromWriteLong(6, 0, 2);
+    setup();
+    loop();
+    host::innerStop = host::shaft - 300;
+    command(":PH#");
+    runMove();
+    check(command(":GP#") == "0005#" && command(":GF#") == "00#" && std::fabs(host::shaft - host::innerStop - 5) <= 1,
+          "homing zeroes on the stop and clears it");
+    host::innerStop = -1e12;
+}
+
+static void checkTimestamps()
+{
+    command(":TS1#");
+    std::string position = command(":GP#"), status = command(">S000#");
+    command(":TS0#");
+    check(command(":GU#").size() == 9 && position.size() == 14 && position[4] == '@' && status.size() == 16 && status[6] == '@'
+          && command(":GP#").size() == 5, "timestamps only when enabled");
+}
+
+static void checkSequence()
+{
+    // Approached from below: outward steps go straight, inward ones overshoot by 4 and come back
+    command(":QC#");
+    command(":QB4#");
+    command(":QA00000020#");
+    bool loaded = command(":QA00000010#") == "02#";
+    bool straight = command(":QN#") == "0000000020#";
+    runMove();
+    straight &= command(":GP#") == "0020#";
+
+    bool started = command(":QN#") == "0100000010#";
+    long lowest = LONG_MAX;
+    for (int i = 0; i < 200000 && command(":GI#") != "0#"; i++)
+    {
+        loop();
+        host::advance(1000);
+        lowest = std::min(lowest, strtol(command(":GP#").c_str(), nullptr, 16));
+    }
+    check(loaded && straight && started && lowest == 0x0c && command(":GP#") == "0010#",
+          "sequence approaches every target from below");
+    check(command(":QN#").substr(0, 2) == "ff" && command(":GQ#") == "0202#", "sequence ends after the last target");
+}
+
+static void checkLimits()
+{
+    // The driver's zero above the motor's, outward timed moves used to overflow the limit
+    int16_t offset = stepperOffset;
+    stepperOffset = -100;
+    command(":MT1ffff#");
+    bool bounded = command(":GN#") == "186a0#";
+    command(":SLffffffff#");
+    command(":MT1ffff#");
+    bounded &= command(":GN#") == "7fffff9b#";
+    command(":FQ#");
+    command(":SL186a0#");
+    stepperOffset = offset;
+    command((":SN" + command(":GP#")).c_str());
+    check(bounded, "timed moves stay inside the travel limit");
+}
+
+template <typename Function>
+static double measure(int iterations, Function function)
+{
+    double start = seconds();
+    for (int i = 0; i < iterations; i++)
+        function();
+    return (seconds() - start) / iterations * 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = (argc > 1) ? atoi(argv[1]) : 200000;
+
+    checkEeprom();
+    checkEncoder();
+    checkPersistence();
+    checkSlip();
+    checkFlats();
+    checkHoming();
+    checkTimestamps();
+    checkSequence();
+    checkLimits();
+
+    printf("\n");
+
+    double ns = measure(iterations, [] { command(":GP#"); });
+    printf("%-48s %8.0f ns  %8.0f/s\n", "parse :GP#", ns, 1e9 / ns);
+    ns = measure(iterations, [] { command(":GM#"); });
+    printf("%-48s %8.0f ns  %8.0f/s\n", "parse :GM#", ns, 1e9 / ns);
+    ns = measure(iterations, [] { command(">S000#"); });
+    printf("%-48s %8.0f ns  %8.0f/s\n", "parse >S000#", ns, 1e9 / ns);
+
+    ns = measure(iterations, [] { loop(); });
+    printf("%-48s %8.0f ns\n", "loop() idle", ns);
+
+    command(":SN00100000#");
+    ns = measure(iterations, [] { loop(); });
+    printf("%-48s %8.0f ns\n", "loop() moving", ns);
+    command(":FQ#");
+
+    // EEPROM writes block the loop, the board spends this long per save
+    uint64_t before = host::now();
+    eepromWriteLong(8, 1234, 4);
+    eepromWriteLong(6, 0, 2);
+    printf("%-48s %8.1f ms\n", "position save (blocking, simulated)", (host::now() - before) / 1000.0);
+
+    return failures ? 1 : 0;
+}
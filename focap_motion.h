@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+/*
+Predicts an AccelStepper move from a single snapshot of its state: accelerate (or brake when
+heading the wrong way), cruise at max speed and decelerate into the target. Good enough to
+interpolate between polls and to know when the move will end.
+*/
+class MotionModel
+{
+    public:
+        struct Sample
+        {
+            double position;
+            double target;
+            double speed;           // steps/s, signed
+            double maxSpeed;        // steps/s
+            double acceleration;    // steps/s^2
+        };
+
+        // time is the host time the sample was taken at, in seconds
+        void update(const Sample &sample, double time)
+        {
+            start = time;
+            origin = sample.position;
+            target = sample.target;
+            direction = (sample.target >= sample.position) ? 1 : -1;
+            count = 0;
+
+            double a = sample.acceleration;
+            double u = sample.speed * direction;
+            double s = std::fabs(sample.target - sample.position);
+
+            if (a <= 0 || (s < 0.5 && std::fabs(u) < 1e-6))
+                return;
+
+            // Moving away from the target, brake first
+            if (u < 0)
+            {
+                add(-u / a, u, a);
+                s += u * u / (2 * a);
+                u = 0;
+            }
+
+            if (s <= u * u / (2 * a))
+            {
+                add(u / a, u, -a);
+                return;
+            }
+
+            double peak = std::min(sample.maxSpeed, std::sqrt(a * s + u * u / 2));
+            double a1 = (peak >= u) ? a : -a;
+            double d1 = (peak * peak - u * u) / (2 * a1);
+            double d3 = peak * peak / (2 * a);
+            double d2 = std::max(0.0, s - d1 - d3);
+
+            add(std::fabs(peak - u) / a, u, a1);
+            add(peak > 0 ? d2 / peak : 0, peak, 0);
+            add(peak / a, peak, -a);
+        }
+
+        double positionAt(double time) const
+        {
+            double elapsed = time - start;
+            if (elapsed >= duration())
+                return target;
+
+            double travelled = 0;
+            for (int i = 0; i < count && elapsed > 0; i++)
+            {
+                double dt = std::min(elapsed, segments[i].duration);
+                travelled += segments[i].speed * dt + 0.5 * segments[i].acceleration * dt * dt;
+                elapsed -= dt;
+            }
+            return origin + direction * travelled;
+        }
+
+        // Host time the move is predicted to end at
+        double arrivalTime() const
+        {
+            return start + duration();
+        }
+
+        bool isMoving(double time) const
+        {
+            return time < arrivalTime();
+        }
+
+    private:
+        struct Segment
+        {
+            double duration;
+            double speed;
+            double acceleration;
+        };
+
+        void add(double duration, double speed, double acceleration)
+        {
+            if (count < 4 && duration > 0)
+                segments[count++] = { duration, speed, acceleration };
+        }
+
+        double duration() const
+        {
+            double total = 0;
+            for (int i = 0; i < count; i++)
+                total += segments[i].duration;
+            return total;
+        }
+
+        Segment segments[4] {};
+        int count { 0 };
+        double start { 0 }, origin { 0 }, target { 0 };
+        int direction { 1 };
+};
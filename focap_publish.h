@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cmath>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+Decides whether a polled property is worth sending to the clients. A property goes out when its
+state changed, a number moved by more than its deadband since it was last sent, or a switch or
+text changed at all. With a minimum interval, value changes of one property are held back until
+that long after its last update; state changes are never held back. Everything not sent is
+counted as saved.
+*/
+class PublishFilter
+{
+    public:
+        bool numberChanged(const std::string &name, int state, const std::vector<double> &values, double deadband, double now)
+        {
+            Entry &entry = entries[name];
+            bool changed = !entry.valid || entry.state != state || entry.values.size() != values.size();
+            for (size_t i = 0; !changed && i < values.size(); i++)
+                changed = std::fabs(values[i] - entry.values[i]) > deadband;
+
+            if (!allow(entry, changed, state, now))
+                return false;
+            entry.values = values;
+            return true;
+        }
+
+        bool textChanged(const std::string &name, int state, const std::string &text, double now)
+        {
+            Entry &entry = entries[name];
+            bool changed = !entry.valid || entry.state != state || entry.text != text;
+
+            if (!allow(entry, changed, state, now))
+                return false;
+            entry.text = text;
+            return true;
+        }
+
+        // Records a property that was sent regardless of the filter
+        void sentNumber(const std::string &name, int state, const std::vector<double> &values, double now)
+        {
+            record(entries[name], state, now);
+            entries[name].values = values;
+        }
+
+        void sentText(const std::string &name, int state, const std::string &text, double now)
+        {
+            record(entries[name], state, now);
+            entries[name].text = text;
+        }
+
+        // A client or INDI itself may have sent something we didn't see, publish everything once more
+        void forget()
+        {
+            for (auto &entry : entries)
+                entry.second.valid = false;
+        }
+
+        void setMinInterval(double seconds)
+        {
+            minInterval = seconds;
+        }
+
+        uint64_t sentCount() const
+        {
+            return sent;
+        }
+
+        uint64_t savedCount() const
+        {
+            return saved;
+        }
+
+    private:
+        struct Entry
+        {
+            bool valid { false };
+            int state { 0 };
+            std::vector<double> values;
+            std::string text;
+            double time { 0 };
+        };
+
+        bool allow(Entry &entry, bool changed, int state, double now)
+        {
+            bool stateChanged = !entry.valid || entry.state != state;
+            if (!changed || (!stateChanged && now - entry.time < minInterval))
+            {
+                saved++;
+                return false;
+            }
+            record(entry, state, now);
+            return true;
+        }
+
+        void record(Entry &entry, int state, double now)
+        {
+            entry.valid = true;
+            entry.state = state;
+            entry.time = now;
+            sent++;
+        }
+
+        std::map<std::string, Entry> entries;
+        double minInterval { 0 };
+        uint64_t sent { 0 }, saved { 0 };
+};
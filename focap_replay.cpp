@@ -0,0 +1,454 @@
+/*
+Replays a Gastro Focap serial trace recorded by the driver
+
+    focap_replay TRACE [-p PORT] [-s SPEED] [-i HOST:PORT] [-t SECONDS]
+
+Plays the device side of the trace on 127.0.0.1:PORT (default 9999): connect the driver's
+network connection there and every command it sends is matched against the recorded one and
+answered with the recorded response after the recorded latency. With -i the property changes
+clients made during the recording are sent to that indiserver at their recorded times, so the
+driver takes the same path it took that night. SPEED divides all recorded delays, and with -i
+the driver's polling period too. Commands the driver only sends over serial are optional, the
+replay always talks TCP.
+
+At the end a summary of matched and diverging commands and of the driver's turnaround is printed.
+The exit code is 0 if the driver sent exactly the recorded commands, 1 if it diverged.
+*/
+
+#include "focap_trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define RESYNC_WINDOW 50            // exchanges to look ahead for a command that doesn't match
+#define POLLING_PROPERTY "POLLING_PERIOD"
+#define POLLING_ELEMENT "PERIOD_MS"
+
+// Sent by the driver on serial connections only, to remember the unit's ID
+static const char *const SERIAL_ONLY[] = { ">I000#" };
+
+struct Exchange
+{
+    uint64_t time;
+    std::string command;
+    char result;                    // 'R' response, 'W' no response expected, 'E' device didn't answer
+    std::string response;
+    uint64_t latency;
+    bool optional;
+};
+
+struct PendingResponse
+{
+    double due;
+    std::string text;
+};
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string xmlEscape(const std::string &text)
+{
+    std::string escaped;
+    for (char c : text)
+    {
+        switch (c)
+        {
+            case '&':
+                escaped += "&amp;";
+                break;
+            case '<':
+                escaped += "&lt;";
+                break;
+            case '>':
+                escaped += "&gt;";
+                break;
+            case '"':
+                escaped += "&quot;";
+                break;
+            default:
+                escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static bool serialOnly(const std::string &command)
+{
+    for (const char *serial : SERIAL_ONLY)
+        if (command == serial)
+            return true;
+    return false;
+}
+
+static std::string clientMessage(const TraceEvent &event, const std::string &device, double speed)
+{
+    const char *vector = (event.type == 'N') ? "Number" : (event.type == 'S') ? "Switch" : "Text";
+
+    std::string xml = std::string("<new") + vector + "Vector device=\"" + xmlEscape(device) + "\" name=\"" + xmlEscape(event.property) + "\">\n";
+    for (const auto &element : event.elements)
+    {
+        // The polling period is a delay like any other
+        std::string value = element.second;
+        if (event.property == POLLING_PROPERTY && element.first == POLLING_ELEMENT)
+            value = std::to_string(std::max(1L, lround(atof(value.c_str()) / speed)));
+        xml += std::string("  <one") + vector + " name=\"" + xmlEscape(element.first) + "\">" + xmlEscape(value) + "</one" + vector + ">\n";
+    }
+    xml += std::string("</new") + vector + "Vector>\n";
+    return xml;
+}
+
+static int connectTo(const std::string &address)
+{
+    size_t colon = address.rfind(':');
+    std::string host = (colon == std::string::npos) ? address : address.substr(0, colon);
+    std::string port = (colon == std::string::npos) ? "7624" : address.substr(colon + 1);
+
+    addrinfo hints {}, *result = nullptr;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+        return -1;
+
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+static void sendAll(int fd, const std::string &text)
+{
+    size_t sent = 0;
+    while (sent < text.size())
+    {
+        ssize_t n = write(fd, text.data() + sent, text.size() - sent);
+        if (n <= 0)
+            return;
+        sent += n;
+    }
+}
+
+// The trace has no record of the polling period unless a client changed it, take the median
+// gap between two requests of the most frequent command, which the driver sends once per poll
+static double recordedPollingPeriod(const std::vector<Exchange> &exchanges)
+{
+    std::map<std::string, std::vector<uint64_t>> times;
+    for (const auto &exchange : exchanges)
+        times[exchange.command].push_back(exchange.time);
+
+    const std::vector<uint64_t> *polled = nullptr;
+    for (const auto &command : times)
+        if (polled == nullptr || command.second.size() > polled->size())
+            polled = &command.second;
+    if (polled == nullptr || polled->size() < 3)
+        return 0;
+
+    std::vector<uint64_t> gaps;
+    for (size_t i = 1; i < polled->size(); i++)
+        gaps.push_back((*polled)[i] - (*polled)[i - 1]);
+    std::nth_element(gaps.begin(), gaps.begin() + gaps.size() / 2, gaps.end());
+    return gaps[gaps.size() / 2] / 1e3;
+}
+
+static std::string pollingMessage(const std::string &device, double period)
+{
+    return "<newNumberVector device=\"" + xmlEscape(device) + "\" name=\"" POLLING_PROPERTY "\">\n  <oneNumber name=\"" POLLING_ELEMENT
+           "\">" + std::to_string(std::max(1L, lround(period))) + "</oneNumber>\n</newNumberVector>\n";
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s TRACE [-p PORT] [-s SPEED] [-i HOST:PORT] [-t SECONDS]\n", argv[0]);
+        return 2;
+    }
+
+    int port = 9999;
+    double speed = 1.0, idleTimeout = 10.0;
+    std::string indiserver;
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "-p"))
+            port = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-s"))
+            speed = std::max(0.001, atof(argv[i + 1]));
+        else if (!strcmp(argv[i], "-i"))
+            indiserver = argv[i + 1];
+        else if (!strcmp(argv[i], "-t"))
+            idleTimeout = atof(argv[i + 1]);
+    }
+
+    std::vector<TraceEvent> events;
+    std::string device;
+    if (!readTrace(argv[1], events, device))
+    {
+        perror(argv[1]);
+        return 2;
+    }
+
+    // Pair every command with what came back
+    std::vector<Exchange> exchanges;
+    std::vector<TraceEvent> actions;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        if (events[i].type == 'C')
+        {
+            Exchange exchange { events[i].time, events[i].text, 'E', "", 0, serialOnly(events[i].text) };
+            if (i + 1 < events.size() && strchr("RWE", events[i + 1].type))
+            {
+                exchange.result = events[i + 1].type;
+                exchange.response = events[i + 1].text;
+                exchange.latency = events[i + 1].latency;
+                i++;
+            }
+            exchanges.push_back(exchange);
+        }
+        else if (strchr("NST", events[i].type))
+            actions.push_back(events[i]);
+    }
+
+    if (exchanges.empty())
+    {
+        fprintf(stderr, "%s: no commands in trace\n", argv[1]);
+        return 2;
+    }
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(server, 1) < 0)
+    {
+        perror("focap_replay");
+        return 2;
+    }
+
+    int indi = -1;
+    if (!indiserver.empty())
+    {
+        indi = connectTo(indiserver);
+        if (indi < 0)
+        {
+            fprintf(stderr, "Unable to connect to indiserver at %s\n", indiserver.c_str());
+            return 2;
+        }
+        sendAll(indi, "<getProperties version=\"1.7\"/>\n");
+    }
+
+    // Without this the driver polls at its own pace and a faster replay runs out of status commands
+    double pollingPeriod = recordedPollingPeriod(exchanges);
+    if (indi >= 0 && speed != 1.0 && pollingPeriod > 0)
+    {
+        fprintf(stderr, "Polling every %.0f ms instead of the recorded %.0f ms\n", pollingPeriod / speed, pollingPeriod);
+        sendAll(indi, pollingMessage(device, pollingPeriod / speed));
+    }
+    else if (speed != 1.0)
+        fprintf(stderr, "The driver polls at its own pace, use -i to scale its polling period too\n");
+
+    fprintf(stderr, "Replaying %zu commands and %zu client actions of %s on 127.0.0.1:%d\n", exchanges.size(), actions.size(),
+            device.c_str(), port);
+
+    int driver = -1;
+    std::string buffer;
+    bool reading = false;
+    size_t next = 0, nextAction = 0;
+    std::vector<PendingResponse> pending;
+    std::map<std::string, std::string> lastResponse;
+
+    // Statistics
+    size_t matched = 0, skipped = 0, unexpected = 0;
+    double replayStart = 0, lastActivity = now(), lastReply = 0;
+    double turnaroundSum = 0, turnaroundMax = 0;
+    size_t turnarounds = 0;
+    const double traceStart = exchanges.front().time / 1e6;
+
+    // Trailing optional commands don't keep the replay waiting
+    size_t required = exchanges.size();
+    while (required > 0 && exchanges[required - 1].optional)
+        required--;
+
+    while (next < required || !pending.empty())
+    {
+        double current = now();
+        if (current - lastActivity > idleTimeout)
+        {
+            fprintf(stderr, "No command for %.0f s, giving up.\n", idleTimeout);
+            break;
+        }
+
+        // Client actions run on the recording's clock, scaled, from the first command on
+        while (replayStart > 0 && nextAction < actions.size() &&
+                current >= replayStart + (actions[nextAction].time / 1e6 - traceStart) / speed)
+        {
+            if (indi >= 0)
+                sendAll(indi, clientMessage(actions[nextAction], device, speed));
+            nextAction++;
+        }
+
+        for (auto it = pending.begin(); it != pending.end();)
+        {
+            if (current >= it->due)
+            {
+                if (driver >= 0)
+                    sendAll(driver, it->text);
+                lastReply = current;
+                it = pending.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        std::vector<pollfd> fds;
+        fds.push_back({server, POLLIN, 0});
+        if (driver >= 0)
+            fds.push_back({driver, POLLIN, 0});
+        if (indi >= 0)
+            fds.push_back({indi, POLLIN, 0});
+        poll(fds.data(), fds.size(), 1);
+
+        for (const auto &fd : fds)
+        {
+            if (!(fd.revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            if (fd.fd == server)
+            {
+                int client = accept(server, nullptr, nullptr);
+                if (client >= 0)
+                {
+                    if (driver >= 0)
+                        close(driver);
+                    driver = client;
+                    setsockopt(driver, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                    buffer.clear();
+                    reading = false;
+                }
+                continue;
+            }
+
+            char data[512];
+            ssize_t n = read(fd.fd, data, sizeof(data));
+            if (n <= 0)
+            {
+                close(fd.fd);
+                if (fd.fd == driver)
+                    driver = -1;
+                else
+                    indi = -1;
+                continue;
+            }
+
+            // Whatever the server says is irrelevant, it only has to be drained
+            if (fd.fd == indi)
+                continue;
+
+            for (ssize_t i = 0; i < n; i++)
+            {
+                char c = data[i];
+                if (c == ':' || c == '>')
+                {
+                    buffer.assign(1, c);
+                    reading = true;
+                    continue;
+                }
+                if (!reading)
+                    continue;
+                buffer += c;
+                if (c != '#')
+                    continue;
+                reading = false;
+
+                double received = now();
+                lastActivity = received;
+                if (replayStart == 0)
+                    replayStart = received;
+                if (lastReply > 0)
+                {
+                    double turnaround = received - lastReply;
+                    turnaroundSum += turnaround;
+                    turnaroundMax = std::max(turnaroundMax, turnaround);
+                    turnarounds++;
+                    lastReply = 0;
+                }
+
+                // Match in order, look ahead a little so one missing command doesn't derail the rest
+                size_t found = next;
+                while (found < exchanges.size() && found < next + RESYNC_WINDOW && exchanges[found].command != buffer)
+                    found++;
+
+                if (found < exchanges.size() && exchanges[found].command == buffer)
+                {
+                    size_t missed = std::count_if(exchanges.begin() + next, exchanges.begin() + found,
+                                                  [](const Exchange &exchange) { return !exchange.optional; });
+                    if (missed > 0)
+                        fprintf(stderr, "Skipped %zu recorded commands before %s\n", missed, buffer.c_str());
+                    skipped += missed;
+                    matched++;
+
+                    const Exchange &exchange = exchanges[found];
+                    if (exchange.result == 'R')
+                    {
+                        pending.push_back({ received + exchange.latency / 1e6 / speed, exchange.response + "#" });
+                        lastResponse[buffer] = exchange.response;
+                    }
+                    else if (exchange.result == 'W')
+                        lastReply = received;
+                    next = found + 1;
+                }
+                else
+                {
+                    // Not in the trace, answer like the device did last time so the driver carries on
+                    fprintf(stderr, "Unexpected command %s\n", buffer.c_str());
+                    unexpected++;
+                    auto last = lastResponse.find(buffer);
+                    if (last != lastResponse.end())
+                        pending.push_back({ received, last->second + "#" });
+                }
+            }
+        }
+    }
+
+    double recorded = (exchanges.back().time - exchanges.front().time) / 1e6;
+    double replayed = replayStart > 0 ? now() - replayStart : 0;
+    size_t notReached = std::count_if(exchanges.begin() + std::min(next, exchanges.size()), exchanges.end(),
+                                      [](const Exchange &exchange) { return !exchange.optional; });
+
+    if (indi >= 0 && speed != 1.0 && pollingPeriod > 0)
+        sendAll(indi, pollingMessage(device, pollingPeriod));
+
+    printf("commands      %zu matched, %zu skipped, %zu unexpected, %zu not reached\n", matched, skipped, unexpected,
+           notReached);
+    printf("duration      %.3f s replayed, %.3f s recorded, speed %.2f\n", replayed, recorded, speed);
+    if (turnarounds > 0)
+        printf("turnaround    %.3f ms mean, %.3f ms max over %zu replies\n", turnaroundSum / turnarounds * 1000,
+               turnaroundMax * 1000, turnarounds);
+
+    if (driver >= 0)
+        close(driver);
+    if (indi >= 0)
+        close(indi);
+    close(server);
+
+    return (skipped == 0 && unexpected == 0 && notReached == 0) ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+#include "focap_telemetry.h"
+
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+TelemetryRecorder::~TelemetryRecorder()
+{
+    close();
+}
+
+bool TelemetryRecorder::open(const std::string &directory, const std::string &deviceName)
+{
+    close();
+    this->directory = directory;
+    this->deviceName = deviceName;
+
+    // File names can't carry spaces nicely
+    for (auto &c : this->deviceName)
+        if (c == ' ' || c == '/')
+            c = '_';
+
+    mkdir(directory.c_str(), 0755);
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return openNight(nightOf(now.tv_sec * 1000000ULL + now.tv_nsec / 1000));
+}
+
+void TelemetryRecorder::close()
+{
+    if (header != nullptr)
+    {
+        // Trim the unused tail of the last chunk
+        uint64_t used = header->count;
+        munmap(header, sizeof(TelemetryHeader) + capacity * sizeof(TelemetrySample));
+        if (ftruncate(fd, sizeof(TelemetryHeader) + used * sizeof(TelemetrySample)) < 0) {}
+        header = nullptr;
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    capacity = 0;
+    night.clear();
+}
+
+std::string TelemetryRecorder::nightOf(uint64_t timestamp)
+{
+    // Shift by 12 hours so everything up to local noon belongs to the previous evening
+    time_t seconds = static_cast<time_t>(timestamp / 1000000ULL) - 12 * 3600;
+    tm local;
+    localtime_r(&seconds, &local);
+
+    char date[16] = {0};
+    strftime(date, sizeof(date), "%Y-%m-%d", &local);
+    return date;
+}
+
+bool TelemetryRecorder::openNight(const std::string &night)
+{
+    std::string directory = this->directory, deviceName = this->deviceName;
+    close();
+    this->night = night;
+
+    path = directory + "/" + deviceName + "_" + night + ".ftl";
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    fstat(fd, &st);
+
+    TelemetryHeader existing {};
+    bool valid = static_cast<size_t>(st.st_size) >= sizeof(TelemetryHeader) &&
+                 pread(fd, &existing, sizeof(existing), 0) == sizeof(existing) &&
+                 memcmp(existing.magic, TELEMETRY_MAGIC, sizeof(existing.magic)) == 0 &&
+                 existing.recordSize == sizeof(TelemetrySample);
+
+    uint64_t count = valid ? existing.count : 0;
+    if (!grow(count + CHUNK_RECORDS))
+    {
+        close();
+        return false;
+    }
+
+    if (!valid)
+    {
+        memcpy(header->magic, TELEMETRY_MAGIC, sizeof(header->magic));
+        header->version = TELEMETRY_VERSION;
+        header->recordSize = sizeof(TelemetrySample);
+        header->count = 0;
+    }
+
+    return true;
+}
+
+bool TelemetryRecorder::grow(uint64_t records)
+{
+    size_t oldSize = sizeof(TelemetryHeader) + capacity * sizeof(TelemetrySample);
+    size_t newSize = sizeof(TelemetryHeader) + records * sizeof(TelemetrySample);
+
+    if (ftruncate(fd, newSize) < 0)
+        return false;
+
+    void *map = (header == nullptr) ?
+                mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+                mremap(header, oldSize, newSize, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+        return false;
+
+    header = static_cast<TelemetryHeader *>(map);
+    capacity = records;
+    return true;
+}
+
+bool TelemetryRecorder::record(const TelemetrySample &sample)
+{
+    if (header == nullptr)
+        return false;
+
+    std::string sampleNight = nightOf(sample.timestamp);
+    if (sampleNight != night && !openNight(sampleNight))
+        return false;
+
+    if (header->count >= capacity && !grow(capacity + CHUNK_RECORDS))
+        return false;
+
+    TelemetrySample *records = reinterpret_cast<TelemetrySample *>(header + 1);
+    records[header->count] = sample;
+    header->count++;
+    return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// On-disk layout of the telemetry log, shared by the driver and focap_telemetry_export.
+// Files are little-endian, a header followed by fixed size records.
+
+#define TELEMETRY_MAGIC "FOCAPTL1"
+#define TELEMETRY_VERSION 1
+
+struct __attribute__((packed)) TelemetryHeader
+{
+    char magic[8];
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t reserved;
+    uint64_t count;                 // number of valid records that follow
+};
+
+struct __attribute__((packed)) TelemetrySample
+{
+    uint64_t timestamp;             // microseconds since the epoch, host clock
+    int32_t position;
+    int32_t target;
+    int16_t temperature;            // hundredths of a degree Celsius
+    uint8_t flags;                  // TELEMETRY_MOVING | TELEMETRY_LIGHT
+    uint8_t cover;                  // shutter status as reported by >S000#
+    uint8_t brightness;
+    uint8_t reserved[3];
+};
+
+enum
+{
+    TELEMETRY_MOVING = 1 << 0,
+    TELEMETRY_LIGHT = 1 << 1
+};
+
+/*
+Appends samples to a memory-mapped file, one file per night. A night runs from local noon to noon,
+so a whole session lands in the same file. The file grows in large chunks, writing a sample is a
+plain memory store.
+*/
+class TelemetryRecorder
+{
+    public:
+        TelemetryRecorder() = default;
+        ~TelemetryRecorder();
+
+        bool open(const std::string &directory, const std::string &deviceName);
+        void close();
+        bool isOpen() const { return header != nullptr; }
+
+        bool record(const TelemetrySample &sample);
+
+        const std::string &fileName() const { return path; }
+
+    private:
+        bool openNight(const std::string &night);
+        bool grow(uint64_t records);
+        static std::string nightOf(uint64_t timestamp);
+
+        std::string directory, deviceName, path, night;
+        int fd { -1 };
+        TelemetryHeader *header { nullptr };
+        uint64_t capacity { 0 };
+
+        static const uint64_t CHUNK_RECORDS { 16384 };
+};
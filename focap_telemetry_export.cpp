@@ -0,0 +1,127 @@
+/*
+Exports a Gastro Focap telemetry log (.ftl) to CSV
+
+    focap_telemetry_export FILE [FROM [TO]]
+
+FROM and TO limit the exported range and are either seconds since the epoch or local time
+as YYYY-MM-DDTHH:MM:SS. Output goes to stdout.
+*/
+
+#include "focap_telemetry.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char *coverNames[] = { "Parked", "Unparked", "Parking", "Unparking" };
+
+static bool parseTime(const char *text, uint64_t &timestamp)
+{
+    tm local {};
+    const char *end = strptime(text, "%Y-%m-%dT%H:%M:%S", &local);
+    if (end != nullptr && *end == '\0')
+    {
+        local.tm_isdst = -1;
+        timestamp = static_cast<uint64_t>(mktime(&local)) * 1000000ULL;
+        return true;
+    }
+
+    char *rest = nullptr;
+    double seconds = strtod(text, &rest);
+    if (rest == text || *rest != '\0')
+        return false;
+    timestamp = static_cast<uint64_t>(seconds * 1000000.0);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s FILE [FROM [TO]]\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t from = 0, to = UINT64_MAX;
+    if ((argc > 2 && !parseTime(argv[2], from)) || (argc > 3 && !parseTime(argv[3], to)))
+    {
+        fprintf(stderr, "Invalid time, use seconds since the epoch or YYYY-MM-DDTHH:MM:SS\n");
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    if (static_cast<size_t>(st.st_size) < sizeof(TelemetryHeader))
+    {
+        fprintf(stderr, "%s: not a telemetry log\n", argv[1]);
+        return 1;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    const TelemetryHeader *header = static_cast<const TelemetryHeader *>(map);
+    if (memcmp(header->magic, TELEMETRY_MAGIC, sizeof(header->magic)) != 0 || header->recordSize != sizeof(TelemetrySample))
+    {
+        fprintf(stderr, "%s: not a telemetry log or unsupported version\n", argv[1]);
+        return 1;
+    }
+
+    // The recorder may still be appending, never read past the file
+    uint64_t count = header->count;
+    uint64_t available = (st.st_size - sizeof(TelemetryHeader)) / sizeof(TelemetrySample);
+    if (count > available)
+        count = available;
+
+    const TelemetrySample *records = reinterpret_cast<const TelemetrySample *>(header + 1);
+
+    // Samples are appended in time order, so binary search the start of the range
+    uint64_t low = 0, high = count;
+    while (low < high)
+    {
+        uint64_t middle = (low + high) / 2;
+        if (records[middle].timestamp < from)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    printf("time,timestamp_us,position,target,temperature,moving,light,brightness,cover\n");
+    for (uint64_t i = low; i < count && records[i].timestamp <= to; i++)
+    {
+        const TelemetrySample &sample = records[i];
+
+        time_t seconds = static_cast<time_t>(sample.timestamp / 1000000ULL);
+        tm local;
+        localtime_r(&seconds, &local);
+        char date[32] = {0};
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &local);
+
+        printf("%s.%03u,%llu,%d,%d,%.2f,%d,%d,%u,%s\n", date,
+               static_cast<unsigned>((sample.timestamp / 1000ULL) % 1000),
+               static_cast<unsigned long long>(sample.timestamp),
+               sample.position, sample.target, sample.temperature / 100.0,
+               (sample.flags & TELEMETRY_MOVING) ? 1 : 0, (sample.flags & TELEMETRY_LIGHT) ? 1 : 0,
+               sample.brightness, sample.cover < 4 ? coverNames[sample.cover] : "Timed out");
+    }
+
+    munmap(map, st.st_size);
+    close(fd);
+    return 0;
+}
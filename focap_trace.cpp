@@ -0,0 +1,188 @@
+#include "focap_trace.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+TraceRecorder::~TraceRecorder()
+{
+    close();
+}
+
+bool TraceRecorder::open(const std::string &path, const std::string &deviceName)
+{
+    close();
+
+    file = fopen(path.c_str(), "w");
+    if (file == nullptr)
+        return false;
+
+    // Line buffered, a crash keeps everything up to the last exchange
+    setvbuf(file, nullptr, _IOLBF, 0);
+    start = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    fprintf(file, "# focap trace 1 %s\n", escape(deviceName).c_str());
+    return true;
+}
+
+void TraceRecorder::close()
+{
+    if (file != nullptr)
+    {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+uint64_t TraceRecorder::now() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+}
+
+uint64_t TraceRecorder::command(const char *command)
+{
+    uint64_t time = now();
+    if (file != nullptr)
+        fprintf(file, "%llu C %s\n", static_cast<unsigned long long>(time), escape(command).c_str());
+    return time;
+}
+
+void TraceRecorder::response(uint64_t sent, const char *response)
+{
+    uint64_t time = now();
+    if (file != nullptr)
+        fprintf(file, "%llu R %llu %s\n", static_cast<unsigned long long>(time), static_cast<unsigned long long>(time - sent),
+                escape(response).c_str());
+}
+
+void TraceRecorder::written(uint64_t sent)
+{
+    uint64_t time = now();
+    if (file != nullptr)
+        fprintf(file, "%llu W %llu\n", static_cast<unsigned long long>(time), static_cast<unsigned long long>(time - sent));
+}
+
+void TraceRecorder::error(uint64_t sent, const char *error)
+{
+    uint64_t time = now();
+    if (file != nullptr)
+        fprintf(file, "%llu E %llu %s\n", static_cast<unsigned long long>(time), static_cast<unsigned long long>(time - sent),
+                escape(error).c_str());
+}
+
+void TraceRecorder::property(char type, const char *name, char *names[], const std::string values[], int n)
+{
+    if (file == nullptr)
+        return;
+
+    fprintf(file, "%llu %c %s", static_cast<unsigned long long>(now()), type, escape(name).c_str());
+    for (int i = 0; i < n; i++)
+        fprintf(file, " %s=%s", escape(names[i]).c_str(), escape(values[i]).c_str());
+    fprintf(file, "\n");
+}
+
+std::string TraceRecorder::escape(const std::string &text)
+{
+    std::string escaped;
+    for (unsigned char c : text)
+    {
+        if (c <= ' ' || c == '%' || c == '=' || c >= 0x7f)
+        {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "%%%02X", c);
+            escaped += hex;
+        }
+        else
+            escaped += c;
+    }
+    return escaped.empty() ? "%" : escaped;
+}
+
+std::string TraceRecorder::unescape(const std::string &text)
+{
+    if (text == "%")
+        return "";
+
+    std::string plain;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        if (text[i] == '%' && i + 2 < text.size())
+        {
+            plain += static_cast<char>(strtol(text.substr(i + 1, 2).c_str(), nullptr, 16));
+            i += 2;
+        }
+        else
+            plain += text[i];
+    }
+    return plain;
+}
+
+bool readTrace(const std::string &path, std::vector<TraceEvent> &events, std::string &deviceName)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty())
+            continue;
+
+        std::istringstream fields(line);
+        if (line[0] == '#')
+        {
+            std::string hash, focap, trace, version, name;
+            fields >> hash >> focap >> trace >> version >> name;
+            deviceName = TraceRecorder::unescape(name);
+            continue;
+        }
+
+        TraceEvent event {};
+        std::string type;
+        fields >> event.time >> type;
+        if (type.size() != 1)
+            continue;
+        event.type = type[0];
+
+        switch (event.type)
+        {
+            case 'C':
+                fields >> event.text;
+                event.text = TraceRecorder::unescape(event.text);
+                break;
+            case 'R':
+            case 'E':
+                fields >> event.latency >> event.text;
+                event.text = TraceRecorder::unescape(event.text);
+                break;
+            case 'W':
+                fields >> event.latency;
+                break;
+            case 'N':
+            case 'S':
+            case 'T':
+            {
+                fields >> event.property;
+                event.property = TraceRecorder::unescape(event.property);
+                std::string element;
+                while (fields >> element)
+                {
+                    size_t equals = element.find('=');
+                    if (equals == std::string::npos)
+                        continue;
+                    event.elements.push_back({ TraceRecorder::unescape(element.substr(0, equals)),
+                                               TraceRecorder::unescape(element.substr(equals + 1)) });
+                }
+                break;
+            }
+            default:
+                continue;
+        }
+
+        events.push_back(event);
+    }
+
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdio>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+Serial traffic trace, one event per line, shared by the driver and focap_replay:
+
+    # focap trace 1 <device>
+    <us> C <command>                    command written to the device
+    <us> R <latency us> <response>      response read, without the terminating #
+    <us> W <latency us>                 command that expects no response was written
+    <us> E <latency us> <error>         write or read failed
+    <us> N|S|T <property> <element>=<value> ...
+                                        client set a number, switch or text property
+
+Times are microseconds since the trace was opened. Commands, responses and values are
+%-escaped, so every field is free of spaces.
+*/
+
+class TraceRecorder
+{
+    public:
+        TraceRecorder() = default;
+        ~TraceRecorder();
+
+        bool open(const std::string &path, const std::string &deviceName);
+        void close();
+        bool isOpen() const { return file != nullptr; }
+
+        // Returns the time of the command, pass it back to the matching response call
+        uint64_t command(const char *command);
+        void response(uint64_t sent, const char *response);
+        void written(uint64_t sent);
+        void error(uint64_t sent, const char *error);
+
+        void property(char type, const char *name, char *names[], const std::string values[], int n);
+
+        static std::string escape(const std::string &text);
+        static std::string unescape(const std::string &text);
+
+    private:
+        uint64_t now() const;
+
+        FILE *file { nullptr };
+        uint64_t start { 0 };
+};
+
+struct TraceEvent
+{
+    uint64_t time;
+    char type;
+    uint64_t latency;
+    std::string text;                   // command, response or error
+    std::string property;
+    std::vector<std::pair<std::string, std::string>> elements;
+};
+
+bool readTrace(const std::string &path, std::vector<TraceEvent> &events, std::string &deviceName);
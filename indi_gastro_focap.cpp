@@ -1,17 +1,44 @@
 #include "indi_gastro_focap.h"
 
 #include "indicom.h"
+#include "indidriver.h"
 #include "connectionplugins/connectionserial.h"
+#include "connectionplugins/connectiontcp.h"
 
 #include <cerrno>
 #include <cstring>
+#include <deque>
+#include <future>
 #include <memory>
+#include <vector>
+#include <glob.h>
+#include <gsl/gsl_cdf.h>
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_multifit.h>
 #include <termios.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
-static std::unique_ptr<Focap> focap(new Focap());
+// One process drives every Focap listed in the DEVICE_COUNT property of the first unit.
+// The count is read straight from the first unit's config file, since all devices have
+// to exist before the first getProperties arrives.
+static class Loader
+{
+        std::deque<std::unique_ptr<Focap>> focaps;
+    public:
+        Loader()
+        {
+            double count = 1;
+            IUGetConfigNumber(Focap::DEFAULT_NAME, "DEVICE_COUNT", "COUNT", &count);
+            count = std::max(1.0, std::min(static_cast<double>(Focap::MAX_DEVICES), count));
+
+            for (uint8_t i = 0; i < static_cast<uint8_t>(count); i++)
+                focaps.push_back(std::unique_ptr<Focap>(new Focap(i)));
+        }
+} loader;
 
 #define FLAT_CMD 7
 #define FLAT_TIMEOUT 5
@@ -19,10 +46,23 @@ static std::unique_ptr<Focap> focap(new Focap());
 #define MIN_ANGLE 0.0
 #define MAX_ANGLE 360.0
 
-Focap::Focap() : LightBoxInterface(this), DustCapInterface(this), FocuserInterface(this)
+Focap::Focap(uint8_t index) : LightBoxInterface(this), DustCapInterface(this), FocuserInterface(this), deviceIndex(index)
 {
     setVersion(1, 1);
 
+    // GSL aborts on errors by default, a degenerate fit must not take the driver down
+    gsl_set_error_handler_off();
+
+    // First unit keeps the plain name so existing configs still apply
+    if (deviceIndex == 0)
+        setDeviceName(DEFAULT_NAME);
+    else
+    {
+        char name[MAXINDINAME] = {0};
+        snprintf(name, MAXINDINAME, "%s %d", DEFAULT_NAME, deviceIndex + 1);
+        setDeviceName(name);
+    }
+
     FI::SetCapability(FOCUSER_CAN_ABS_MOVE | FOCUSER_CAN_REL_MOVE | FOCUSER_CAN_ABORT | FOCUSER_CAN_SYNC);
 }
 
@@ -45,6 +85,18 @@ bool Focap::initProperties()
     IUFillNumber(&AnglesN[1], "UNPARK_ANGLE", "Unpark", "%.0f", MIN_ANGLE, MAX_ANGLE, 5.0, 270.0);
     IUFillNumberVector(&AnglesNP, AnglesN, 2, getDeviceName(), "COVER_ANGLES", "Cover Angles", FLATCAP_TAB, IP_RW, 60, IPS_IDLE);
 
+    UnitTP[UnitId].fill("ID", "Unit ID", "");
+    UnitTP[LastPort].fill("LAST_PORT", "Last port", "");
+    UnitTP.fill(getDeviceName(), "FOCAP_UNIT", "Unit", CONNECTION_TAB, IP_RW, 60, IPS_IDLE);
+
+    ServoProfileNP[ServoSpeed].fill("SPEED", "Speed (°/s)", "%.0f", 1, 600, 10, 50);
+    ServoProfileNP[ServoAcceleration].fill("ACCELERATION", "Acceleration (°/s²)", "%.0f", 1, 999, 10, 100);
+    ServoProfileNP.fill(getDeviceName(), "COVER_PROFILE", "Cover Motion", FLATCAP_TAB, IP_RW, 60, IPS_IDLE);
+
+    FlatSessionSP[FlatsStart].fill("START", "Start flats", ISS_OFF);
+    FlatSessionSP[FlatsFinish].fill("FINISH", "Finish flats", ISS_OFF);
+    FlatSessionSP.fill(getDeviceName(), "FLAT_SESSION", "Flats", FLATCAP_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
     TemperatureNP[0].fill("TEMPERATURE", "Celsius", "%6.2f", -50, 70., 0., 0.);
     TemperatureNP.fill(getDeviceName(), "FOCUS_TEMPERATURE", "Temperature", MAIN_CONTROL_TAB, IP_RO, 0, IPS_IDLE);
 
@@ -56,6 +108,118 @@ bool Focap::initProperties()
     TemperatureCompensateSP[INDI_DISABLED].fill("Disable", "", ISS_ON);
     TemperatureCompensateSP.fill(getDeviceName(), "T. Compensate", "", FOCUSER_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
 
+    FocusEtaNP[0].fill("ETA", "Seconds", "%.1f", 0, 3600, 0, 0);
+    FocusEtaNP.fill(getDeviceName(), "FOCUS_ETA", "Arrival", FOCUSER_TAB, IP_RO, 0, IPS_IDLE);
+
+    SampleTimeNP[PositionTime].fill("POSITION", "Position (s)", "%.6f", 0, 1e10, 0, 0);
+    SampleTimeNP[TemperatureTime].fill("TEMPERATURE", "Temperature (s)", "%.6f", 0, 1e10, 0, 0);
+    SampleTimeNP.fill(getDeviceName(), "SAMPLE_TIME", "Sampled at", FOCUSER_TAB, IP_RO, 0, IPS_IDLE);
+
+    ClockSyncNP[ClockOffset].fill("OFFSET", "Offset (ms)", "%.3f", -1e12, 1e12, 0, 0);
+    ClockSyncNP[ClockDrift].fill("DRIFT", "Drift (ppm)", "%.1f", -1e6, 1e6, 0, 0);
+    ClockSyncNP[ClockError].fill("ERROR", "Error (ms)", "%.3f", 0, 1e6, 0, 0);
+    ClockSyncNP.fill(getDeviceName(), "CLOCK_SYNC", "Device clock", DIAGNOSTICS_TAB, IP_RO, 0, IPS_IDLE);
+
+    HomeSP[0].fill("HOME", "Home", ISS_OFF);
+    HomeSP.fill(getDeviceName(), "FOCUS_HOME", "Home", FOCUSER_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+    SequenceTP[0].fill("TARGETS", "Targets", "");
+    SequenceTP.fill(getDeviceName(), "FOCUS_SEQUENCE", "Sequence", FOCUSER_TAB, IP_RW, 60, IPS_IDLE);
+
+    SequenceApproachNP[0].fill("OVERSHOOT", "Overshoot (steps)", "%.0f", -10000, 10000, 10, 0);
+    SequenceApproachNP.fill(getDeviceName(), "FOCUS_SEQUENCE_APPROACH", "Approach", FOCUSER_TAB, IP_RW, 60, IPS_IDLE);
+
+    SequenceSP[SequenceNext].fill("NEXT", "Next", ISS_OFF);
+    SequenceSP[SequenceRestart].fill("RESTART", "Restart", ISS_OFF);
+    SequenceSP.fill(getDeviceName(), "FOCUS_SEQUENCE_STEP", "Sequence", FOCUSER_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+    SequenceStateNP[SequenceStep].fill("STEP", "Step", "%.0f", 0, MAX_SEQUENCE_STEPS, 0, 0);
+    SequenceStateNP[SequenceSteps].fill("STEPS", "Steps", "%.0f", 0, MAX_SEQUENCE_STEPS, 0, 0);
+    SequenceStateNP.fill(getDeviceName(), "FOCUS_SEQUENCE_STATE", "Sequence", FOCUSER_TAB, IP_RO, 0, IPS_IDLE);
+
+    static const char *phases[LOOP_PHASES][2] = { { "ENCODER", "Encoder" }, { "STEPPER", "Stepper" }, { "SERVO", "Servo" },
+                                                  { "STORAGE", "Storage" }, { "COMMANDS", "Commands" }, { "LOOP", "Loop" } };
+    static const char *stats[3][2] = { { "MIN", "min" }, { "AVG", "avg" }, { "MAX", "max" } };
+    for (int i = 0; i < LOOP_PHASES; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            char name[MAXINDINAME], label[MAXINDILABEL];
+            snprintf(name, MAXINDINAME, "%s_%s", phases[i][0], stats[j][0]);
+            snprintf(label, MAXINDILABEL, "%s %s (µs)", phases[i][1], stats[j][1]);
+            LoopTimingNP[i * 3 + j].fill(name, label, "%.0f", 0, 65535, 0, 0);
+        }
+    }
+    LoopTimingNP[LOOP_PHASES * 3].fill("RUN_GAP_MAX", "Max step gap (µs)", "%.0f", 0, 65535, 0, 0);
+    LoopTimingNP.fill(getDeviceName(), "LOOP_TIMING", "Loop timing", DIAGNOSTICS_TAB, IP_RO, 0, IPS_IDLE);
+
+    static const char *buckets[LOOP_BUCKETS] = { "< 50 µs", "< 100 µs", "< 200 µs", "< 500 µs", "< 1 ms", "< 2 ms", "< 5 ms", ">= 5 ms" };
+    for (int i = 0; i < LOOP_BUCKETS; i++)
+    {
+        char name[MAXINDINAME];
+        snprintf(name, MAXINDINAME, "BUCKET_%d", i);
+        LoopHistogramNP[i].fill(name, buckets[i], "%.0f", 0, 65535, 0, 0);
+    }
+    LoopHistogramNP.fill(getDeviceName(), "LOOP_HISTOGRAM", "Loop times", DIAGNOSTICS_TAB, IP_RO, 0, IPS_IDLE);
+
+    LoopProfileSP[0].fill("READ", "Read and reset", ISS_OFF);
+    LoopProfileSP.fill(getDeviceName(), "LOOP_PROFILE", "Profile", DIAGNOSTICS_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+    MotorCurrentNP[RunCurrent].fill("RUN", "Run (mA)", "%.0f", 50, 1500, 50, 600);
+    MotorCurrentNP[HoldCurrent].fill("HOLD", "Hold (%)", "%.0f", 0, 100, 5, 30);
+    MotorCurrentNP[HoldDelay].fill("HOLD_DELAY", "Hold delay", "%.0f", 0, 15, 1, 4);
+    // TPOWERDOWN 255 reads back as blank EEPROM on the unit, 254 is the longest that survives a reboot
+    MotorCurrentNP[PowerDown].fill("POWER_DOWN", "Power down (ms)", "%.0f", 0, POWER_DOWN_MS * 254, POWER_DOWN_MS, 420);
+    MotorCurrentNP.fill(getDeviceName(), "MOTOR_CURRENT", "Current", FOCUSER_TAB, IP_RW, 60, IPS_IDLE);
+
+    IdleModeSP[IdleHold].fill("HOLD", "Hold current", ISS_ON);
+    IdleModeSP[IdleDisable].fill("DISABLE", "Disable", ISS_OFF);
+    IdleModeSP.fill(getDeviceName(), "MOTOR_IDLE", "Idle", FOCUSER_TAB, IP_RW, ISR_1OFMANY, 60, IPS_IDLE);
+
+    FocusSampleNP[SampleTemperature].fill("TEMPERATURE", "Temperature", "%6.2f", -50, 70, 0, 0);
+    FocusSampleNP[SamplePosition].fill("POSITION", "Best focus", "%.0f", 0, 100000, 0, 0);
+    FocusSampleNP.fill(getDeviceName(), "FOCUS_SAMPLE", "Focus sample", FOCUSER_TAB, IP_RW, 0, IPS_IDLE);
+
+    CoefficientFitSP[FitAddCurrent].fill("ADD_CURRENT", "Add current", ISS_OFF);
+    CoefficientFitSP[FitApply].fill("APPLY", "Apply", ISS_OFF);
+    CoefficientFitSP[FitClear].fill("CLEAR", "Clear", ISS_OFF);
+    CoefficientFitSP.fill(getDeviceName(), "COEFFICIENT_FIT", "Fit", FOCUSER_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+    CoefficientFitNP[FitCoefficient].fill("COEFFICIENT", "Steps/°C", "%6.2f", -1000, 1000, 0, 0);
+    CoefficientFitNP[FitConfidence].fill("CONFIDENCE", "± 95%", "%6.2f", 0, 1000, 0, 0);
+    CoefficientFitNP[FitSamples].fill("SAMPLES", "Samples", "%.0f", 0, MAX_FOCUS_SAMPLES, 0, 0);
+    CoefficientFitNP.fill(getDeviceName(), "COEFFICIENT_FIT_RESULT", "Fitted", FOCUSER_TAB, IP_RO, 0, IPS_IDLE);
+
+    TelemetrySP[INDI_ENABLED].fill("Enable", "", ISS_OFF);
+    TelemetrySP[INDI_DISABLED].fill("Disable", "", ISS_ON);
+    TelemetrySP.fill(getDeviceName(), "TELEMETRY", "Telemetry", OPTIONS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+    char telemetryDirectory[MAXRBUF] = {0};
+    snprintf(telemetryDirectory, MAXRBUF, "%s/.indi/telemetry", getenv("HOME") ? getenv("HOME") : "/tmp");
+    TelemetryTP[0].fill("DIRECTORY", "Directory", telemetryDirectory);
+    TelemetryTP.fill(getDeviceName(), "TELEMETRY_DIRECTORY", "Telemetry", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+    TraceSP[INDI_ENABLED].fill("Enable", "", ISS_OFF);
+    TraceSP[INDI_DISABLED].fill("Disable", "", ISS_ON);
+    TraceSP.fill(getDeviceName(), "TRACE", "Trace", OPTIONS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+    char traceFile[MAXRBUF] = {0};
+    snprintf(traceFile, MAXRBUF, "%s/.indi/focap_%d.trace", getenv("HOME") ? getenv("HOME") : "/tmp", deviceIndex + 1);
+    TraceTP[0].fill("FILE", "File", traceFile);
+    TraceTP.fill(getDeviceName(), "TRACE_FILE", "Trace", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+    PublishNP[PositionDeadband].fill("POSITION", "Position (steps)", "%.0f", 0, 1000, 1, 5);
+    PublishNP[TemperatureDeadband].fill("TEMPERATURE", "Temperature (°C)", "%.2f", 0, 5, 0.05, 0.5);
+    PublishNP[MinInterval].fill("MIN_INTERVAL", "Min interval (ms)", "%.0f", 0, 10000, 100, 0);
+    PublishNP.fill(getDeviceName(), "PUBLISH_DEADBAND", "Updates", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+    PublishStatsNP[MessagesSent].fill("SENT", "Sent", "%.0f", 0, 1e12, 0, 0);
+    PublishStatsNP[MessagesSaved].fill("SAVED", "Saved", "%.0f", 0, 1e12, 0, 0);
+    PublishStatsNP.fill(getDeviceName(), "PUBLISH_STATS", "Updates", DIAGNOSTICS_TAB, IP_RO, 0, IPS_IDLE);
+
+    DeviceCountNP[0].fill("COUNT", "Units", "%.0f", 1, MAX_DEVICES, 1, 1);
+    DeviceCountNP.fill(getDeviceName(), "DEVICE_COUNT", "Devices", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
     FocusRelPosNP[0].setMin(0.);
     FocusRelPosNP[0].setMax(50000.);
     FocusRelPosNP[0].setValue(0);
@@ -83,6 +247,13 @@ bool Focap::initProperties()
     serialConnection->registerHandshake([&]() { return Handshake(); });
     registerConnection(serialConnection);
 
+    // Same protocol over Wi-Fi, the firmware listens on TCP_PORT and announces WIFI_HOSTNAME over mDNS
+    tcpConnection = new Connection::TCP(this);
+    tcpConnection->setDefaultHost("focap.local");
+    tcpConnection->setDefaultPort(9999);
+    tcpConnection->registerHandshake([&]() { return Handshake(); });
+    registerConnection(tcpConnection);
+
     return true;
 }
 
@@ -90,6 +261,23 @@ void Focap::ISGetProperties(const char *dev)
 {
     INDI::DefaultDevice::ISGetProperties(dev);
     LI::ISGetProperties(dev);
+
+    // Needed before connecting, discovery looks for this unit
+    defineProperty(UnitTP);
+    loadConfig(true, UnitTP.getName());
+
+    // Also before connecting, so the handshake ends up in the trace
+    defineProperty(TraceTP);
+    defineProperty(TraceSP);
+    loadConfig(true, TraceTP.getName());
+    loadConfig(true, TraceSP.getName());
+
+    // Only the first unit decides how many units this process drives
+    if (deviceIndex == 0)
+    {
+        defineProperty(DeviceCountNP);
+        loadConfig(true, DeviceCountNP.getName());
+    }
 }
 
 bool Focap::updateProperties()
@@ -109,17 +297,104 @@ bool Focap::updateProperties()
         defineProperty(TemperatureSettingNP);
         defineProperty(TemperatureCompensateSP);
 
+        defineProperty(FocusEtaNP);
+        defineProperty(FocusSampleNP);
+        defineProperty(CoefficientFitSP);
+        defineProperty(CoefficientFitNP);
+
+        defineProperty(TelemetrySP);
+        defineProperty(TelemetryTP);
+        defineProperty(PublishNP);
+        defineProperty(PublishStatsNP);
+
+        publisher.forget();
         GetFocusParams();
         getStartupData();
+
+        // Needs the firmware version from the startup data
+        if (firmwareVersion >= SERVO_PROFILE_FIRMWARE)
+            defineProperty(ServoProfileNP);
+
+        if (firmwareVersion >= CURRENTS_FIRMWARE)
+        {
+            defineProperty(MotorCurrentNP);
+            defineProperty(IdleModeSP);
+            getMotorCurrents();
+        }
+
+        if (firmwareVersion >= PROFILE_FIRMWARE)
+        {
+            defineProperty(LoopProfileSP);
+            defineProperty(LoopTimingNP);
+            defineProperty(LoopHistogramNP);
+        }
+
+        if (firmwareVersion >= FLATS_FIRMWARE)
+            defineProperty(FlatSessionSP);
+
+        if (firmwareVersion >= HOMING_FIRMWARE)
+            defineProperty(HomeSP);
+
+        if (firmwareVersion >= SEQUENCE_FIRMWARE)
+        {
+            defineProperty(SequenceTP);
+            defineProperty(SequenceApproachNP);
+            defineProperty(SequenceSP);
+            defineProperty(SequenceStateNP);
+            sequenceNext = 0;
+            if (!sequenceTargets.empty())
+                uploadSequence();
+        }
+
+        if (firmwareVersion >= TIMESTAMP_FIRMWARE)
+        {
+            defineProperty(SampleTimeNP);
+            defineProperty(ClockSyncNP);
+            startTimestamps();
+        }
+
+        // The focuser interface only offers timed moves to focusers without absolute positioning
+        if (firmwareVersion >= NATIVE_MOVE_FIRMWARE)
+        {
+            defineProperty(FocusTimerNP);
+            SetFocuserMaxPosition(static_cast<uint32_t>(FocusMaxPosNP[0].getValue()));
+        }
     }
     else
     {
         deleteProperty(StatusTP.name);
         deleteProperty(FirmwareTP.name);
         deleteProperty(AnglesNP.name);
+        deleteProperty(ServoProfileNP.getName());
+        cancelCoverTimeout();
         deleteProperty(TemperatureNP.getName());
         deleteProperty(TemperatureSettingNP.getName());
         deleteProperty(TemperatureCompensateSP.getName());
+        deleteProperty(FocusEtaNP.getName());
+        deleteProperty(LoopProfileSP.getName());
+        deleteProperty(LoopTimingNP.getName());
+        deleteProperty(LoopHistogramNP.getName());
+        deleteProperty(FocusTimerNP.getName());
+        deleteProperty(FlatSessionSP.getName());
+        deleteProperty(HomeSP.getName());
+        deleteProperty(SequenceTP.getName());
+        deleteProperty(SequenceApproachNP.getName());
+        deleteProperty(SequenceSP.getName());
+        deleteProperty(SequenceStateNP.getName());
+        deleteProperty(SampleTimeNP.getName());
+        deleteProperty(ClockSyncNP.getName());
+        flatsPending = false;
+        deleteProperty(MotorCurrentNP.getName());
+        deleteProperty(IdleModeSP.getName());
+        deleteProperty(FocusSampleNP.getName());
+        deleteProperty(CoefficientFitSP.getName());
+        deleteProperty(CoefficientFitNP.getName());
+        deleteProperty(TelemetrySP.getName());
+        deleteProperty(TelemetryTP.getName());
+        deleteProperty(PublishNP.getName());
+        deleteProperty(PublishStatsNP.getName());
+
+        telemetry.close();
     }
 
     return true;
@@ -127,7 +402,7 @@ bool Focap::updateProperties()
 
 const char *Focap::getDefaultName()
 {
-    return "Gastro Focap";
+    return DEFAULT_NAME;
 }
 
 bool Focap::Handshake()
@@ -143,20 +418,271 @@ bool Focap::Handshake()
         return true;
     }
 
-    PortFD = serialConnection->getPortFD();
+    if (getActiveConnection() == tcpConnection)
+        PortFD = tcpConnection->getPortFD();
+    else
+        PortFD = serialConnection->getPortFD();
 
-    tcflush(PortFD, TCIOFLUSH);
+    flushPort();
 
     syncDriverInfo();
 
-    return Ack();
+    handshaking = true;
+    bool acked = Ack();
+    handshaking = false;
+    if (!acked)
+    {
+        PortFD = -1;
+        return false;
+    }
+
+    if (getActiveConnection() == serialConnection)
+        rememberUnit(serialConnection->port());
+
+    // A reconnect runs from the poll timer, which sets itself again
+    if (!linkLost)
+        SetTimer(getCurrentPollingPeriod());
+    return true;
+}
+
+bool Focap::Connect()
+{
+    // Find the unit before the serial plugin tries the stale port and falls back to its slow search
+    if (!isSimulation() && getActiveConnection() == serialConnection && hasUnitId())
+    {
+        std::string port = discoverPort();
+        if (port.empty())
+            LOG_WARN("Focap not found on any serial port, trying the configured port.");
+        else
+        {
+            LOGF_INFO("Found Focap on %s.", port.c_str());
+            serialConnection->setDefaultPort(port.c_str());
+        }
+    }
+
+    linkLost = false;
+    linkFailures = 0;
+    return INDI::DefaultDevice::Connect();
+}
+
+/*
+Opens the port, asks for the unit ID with a short timeout and returns it, or an empty string if
+nothing that speaks the Focap protocol answered. Runs on a worker thread, so no driver state here.
+*/
+static std::string probeUnitId(const std::string &port)
+{
+    int fd = -1;
+    if (tty_connect(port.c_str(), 9600, 8, 0, 1, &fd) != TTY_OK)
+        return "";
+
+    std::string id;
+    char response[32] = {0};
+    int nbytes_written = 0, nbytes_read = 0;
+
+    tcflush(fd, TCIOFLUSH);
+    if (tty_write_string(fd, ">I000#", &nbytes_written) == TTY_OK &&
+            tty_nread_section_expanded(fd, response, sizeof(response) - 1, '#', 0, 400000, &nbytes_read) == TTY_OK &&
+            nbytes_read > 2 && response[0] == '*' && response[1] == 'I')
+    {
+        response[nbytes_read - 1] = 0;
+        id = response + 2;
+    }
+
+    tty_disconnect(fd);
+    return id;
+}
+
+bool Focap::hasUnitId()
+{
+    return UnitTP[UnitId].getText() != nullptr && UnitTP[UnitId].getText()[0] != 0;
+}
+
+// Only looks for a known unit, any Focap would do otherwise and another unit's port could be taken
+std::string Focap::discoverPort()
+{
+    if (!hasUnitId())
+        return "";
+
+    std::string wantedId = UnitTP[UnitId].getText();
+    std::string lastPort = UnitTP[LastPort].getText() ? UnitTP[LastPort].getText() : "";
+
+    auto matches = [&](const std::string &id)
+    {
+        return id == wantedId;
+    };
+
+    // Last known good port first, usually nothing re-enumerated
+    if (!lastPort.empty() && matches(probeUnitId(lastPort)))
+        return lastPort;
+
+    std::vector<std::string> candidates;
+    for (const char *pattern : { "/dev/ttyUSB*", "/dev/ttyACM*" })
+    {
+        glob_t paths;
+        if (glob(pattern, 0, nullptr, &paths) == 0)
+        {
+            for (size_t i = 0; i < paths.gl_pathc; i++)
+                if (lastPort != paths.gl_pathv[i])
+                    candidates.push_back(paths.gl_pathv[i]);
+        }
+        globfree(&paths);
+    }
+
+    // Probe every candidate at once, ports held by other units or programs fail to lock right away
+    std::vector<std::future<std::string>> probes;
+    for (const auto &port : candidates)
+        probes.push_back(std::async(std::launch::async, probeUnitId, port));
+
+    std::string found;
+    for (size_t i = 0; i < probes.size(); i++)
+    {
+        std::string id = probes[i].get();
+        if (found.empty() && matches(id))
+            found = candidates[i];
+    }
+
+    return found;
+}
+
+/*
+Reopens the port without touching the driver's state. USB adapters tend to come back under another
+name after a glitch, so the serial port is looked for by unit ID first; if the unit isn't on any
+port there is no point in letting the serial plugin search them all.
+*/
+bool Focap::reconnect()
+{
+    Connection::Interface *connection = getActiveConnection();
+    connection->Disconnect();
+    PortFD = -1;
+
+    // Without a unit ID the configured port is the only one that is certainly ours
+    if (connection == serialConnection && hasUnitId())
+    {
+        std::string port = discoverPort();
+        if (port.empty())
+        {
+            LOGF_DEBUG("Focap not found, next attempt in %u s.", reconnectDelay / 1000);
+            return false;
+        }
+        serialConnection->setDefaultPort(port.c_str());
+    }
+
+    // The plugin's own search would handshake every port on the shared event loop, and could
+    // take another unit's port; discoverPort() already searched
+    bool serial = connection == serialConnection;
+    if (serial)
+        setAutoSearch(false);
+    bool connected = connection->Connect();
+    if (serial && autoSearchWanted)
+        setAutoSearch(true);
+
+    if (!connected)
+    {
+        LOGF_DEBUG("Reconnect failed, next attempt in %u s.", reconnectDelay / 1000);
+        return false;
+    }
+
+    linkLost = false;
+    linkFailures = 0;
+    StatusTP.s = IPS_OK;
+    LOG_INFO("Link to the Focap restored.");
+    return true;
+}
+
+// Goes to the plugin directly, so the user's choice recorded in ISNewSwitch() stays as it was
+void Focap::setAutoSearch(bool enable)
+{
+    ISState states[2] = { enable ? ISS_ON : ISS_OFF, enable ? ISS_OFF : ISS_ON };
+    char enabled[] = "INDI_ENABLED", disabled[] = "INDI_DISABLED";
+    char *names[2] = { enabled, disabled };
+    serialConnection->ISNewSwitch(getDeviceName(), "DEVICE_AUTO_SEARCH", states, names, 2);
+}
+
+/*
+Brings the cached state back in line with the unit after a reconnect, without the startup sequence.
+The unit may have been reset with the link (USB resets toggle DTR): a move that was in flight is
+sent again, brightness and light are restored to what the clients last set, and the cover state
+is taken from the unit, which keeps it in EEPROM.
+*/
+void Focap::resync()
+{
+    publisher.forget();
+
+    // A reset unit forgot the timestamps and started its clock over
+    if (firmwareVersion >= TIMESTAMP_FIRMWARE)
+        startTimestamps();
+
+    bool lightWanted = LightSP[FLAT_LIGHT_ON].getState() == ISS_ON;
+    double brightness = LightIntensityNP[0].getValue();
+
+    // Adopt whatever the unit says the cover is doing
+    if (ParkCapSP.getState() == IPS_OK)
+        ParkCapSP.setState(IPS_IDLE);
+    if (!getStatus())
+        return;
+
+    if (getBrightness() && LightIntensityNP[0].getValue() != brightness)
+    {
+        LOGF_WARN("Brightness was reset to %.0f, restoring %.0f.", LightIntensityNP[0].getValue(), brightness);
+        SetLightBoxBrightness(static_cast<uint16_t>(brightness));
+    }
+    if (lightWanted && lightState == 0 && coverState == 0 && !flatsPending)
+    {
+        LOG_WARN("Light went off with the link, switching it on again.");
+        if (EnableLightBox(true))
+        {
+            LightSP.reset();
+            LightSP[FLAT_LIGHT_ON].setState(ISS_ON);
+            LightSP.setState(IPS_OK);
+            LightSP.apply();
+        }
+    }
+
+    if (firmwareVersion >= SEQUENCE_FIRMWARE)
+        checkSequence();
+
+    // The travel limit, temperature coefficient and compensation only live in the unit's RAM
+    if (firmwareVersion >= NATIVE_MOVE_FIRMWARE)
+        SetFocuserMaxPosition(static_cast<uint32_t>(FocusMaxPosNP[0].getValue()));
+    setTemperatureCoefficient(TemperatureSettingNP[Coefficient].getValue());
+    setTemperatureCompensation(TemperatureCompensateSP[INDI_ENABLED].getState() == ISS_ON);
+    if (firmwareVersion >= CURRENTS_FIRMWARE)
+        restoreMotorCurrents();
+
+    bool moving = FocusAbsPosNP.getState() == IPS_BUSY || FocusRelPosNP.getState() == IPS_BUSY;
+    bool rc = (firmwareVersion >= MOTION_FIRMWARE) ? readMotion() : readPosition();
+    if (rc && moving && !focuserState && FocusTimerNP.getState() != IPS_BUSY)
+    {
+        uint32_t position = static_cast<uint32_t>(FocusAbsPosNP[0].getValue());
+        if (position != targetPos)
+        {
+            LOGF_WARN("Move to %u was interrupted at %u, resuming.", targetPos, position);
+            MoveFocuser(targetPos);
+        }
+    }
+}
+
+void Focap::rememberUnit(const char *port)
+{
+    char response[RES_LENGTH] = {0};
+    if (!sendCommand(">I000#", response) || strncmp(response, "*I", 2) != 0)
+        return;
+
+    // First connection binds this device to the unit, later discoveries only accept that unit
+    if (UnitTP[UnitId].getText() == nullptr || UnitTP[UnitId].getText()[0] == '\0')
+        UnitTP[UnitId].setText(response + 2);
+    UnitTP[LastPort].setText(port);
+    UnitTP.setState(IPS_OK);
+    UnitTP.apply();
+    saveConfig(true, UnitTP.getName());
 }
 
 bool Focap::Ack()
 {
     bool success = false;
 
-    for (int i = 0; i < 3; i++)
+    // Reconnect attempts back off on their own, one ping is enough to tell
+    for (int i = 0; i < (linkLost ? 1 : 3); i++)
     {
         if (ping())
         {
@@ -183,6 +709,7 @@ bool Focap::readTemperature()
     {
         // Signed hex
         TemperatureNP[0].setValue((static_cast<int32_t>(temp) - (1 << 15)) / 128.0);
+        temperatureTime = sampleTime(res);
     }
     else
     {
@@ -224,7 +751,10 @@ bool Focap::readPosition()
     int rc = sscanf(res, "%x#", &pos);
 
     if (rc > 0)
+    {
         FocusAbsPosNP[0].setValue(pos);
+        positionTime = sampleTime(res);
+    }
     else
     {
         // LOGF_ERROR("Unknown error: focuser position value (%s)", res);
@@ -261,6 +791,14 @@ bool Focap::setTemperatureCalibration(double calibration)
 
 bool Focap::setTemperatureCoefficient(double coefficient)
 {
+    // Sent as signed 8.8 fixed point, the property range keeps it well inside
+    double min = TemperatureSettingNP[Coefficient].getMin(), max = TemperatureSettingNP[Coefficient].getMax();
+    if (!std::isfinite(coefficient) || coefficient < min || coefficient > max)
+    {
+        LOGF_ERROR("Temperature coefficient %.2f is out of range (%.0f to %.0f steps/°C).", coefficient, min, max);
+        return false;
+    }
+
     char cmd[RES_LENGTH] = {0};
     uint16_t hex = static_cast<int16_t>(coefficient * 256.0);
     snprintf(cmd, RES_LENGTH, ":SC%04x#", hex);
@@ -297,6 +835,45 @@ bool Focap::ISNewNumber(const char *dev, const char *name, double values[], char
 {
     if (dev != nullptr && strcmp(dev, getDeviceName()) == 0)
     {
+        if (trace.isOpen())
+        {
+            std::vector<std::string> text(n);
+            for (int i = 0; i < n; i++)
+            {
+                char value[32] = {0};
+                snprintf(value, sizeof(value), "%.17g", values[i]);
+                text[i] = value;
+            }
+            trace.property('N', name, names, text.data(), n);
+        }
+
+        // Whatever the handlers below apply bypasses the filter
+        publisher.forget();
+
+        if (PublishNP.isNameMatch(name))
+        {
+            PublishNP.update(values, names, n);
+            PublishNP.setState(IPS_OK);
+            PublishNP.apply();
+            applyPublishOptions();
+            saveConfig(true, PublishNP.getName());
+            return true;
+        }
+
+        if (SequenceApproachNP.isNameMatch(name))
+        {
+            SequenceApproachNP.update(values, names, n);
+            int overshoot = static_cast<int>(SequenceApproachNP[0].getValue());
+            char cmd[RES_LENGTH] = {0};
+            snprintf(cmd, RES_LENGTH, ":QB%s%x#", overshoot < 0 ? "-" : "", std::abs(overshoot));
+            bool rc = sendCommand(cmd);
+            SequenceApproachNP.setState(rc ? IPS_OK : IPS_ALERT);
+            SequenceApproachNP.apply();
+            if (rc)
+                saveConfig(true, SequenceApproachNP.getName());
+            return rc;
+        }
+
         if (strcmp(name, "ANGLES") == 0)
         {
             for (int i = 0; i < n; i++)
@@ -312,6 +889,15 @@ bool Focap::ISNewNumber(const char *dev, const char *name, double values[], char
             }
             return true;
         }
+        if (ServoProfileNP.isNameMatch(name))
+        {
+            ServoProfileNP.update(values, names, n);
+            bool rc = setServoProfile(static_cast<uint16_t>(ServoProfileNP[ServoSpeed].getValue()),
+                                      static_cast<uint16_t>(ServoProfileNP[ServoAcceleration].getValue()));
+            ServoProfileNP.setState(rc ? IPS_OK : IPS_ALERT);
+            ServoProfileNP.apply();
+            return rc;
+        }
         if (LI::processNumber(dev, name, values, names, n))
         {
             return true;
@@ -322,10 +908,12 @@ bool Focap::ISNewNumber(const char *dev, const char *name, double values[], char
         }
         if (TemperatureSettingNP.isNameMatch(name))
         {
+            double coefficient = TemperatureSettingNP[Coefficient].getValue();
             TemperatureSettingNP.update(values, names, n);
             if (!setTemperatureCalibration(TemperatureSettingNP[Calibration].getValue()) ||
                 !setTemperatureCoefficient(TemperatureSettingNP[Coefficient].getValue()))
             {
+                TemperatureSettingNP[Coefficient].setValue(coefficient);
                 TemperatureSettingNP.setState(IPS_ALERT);
                 TemperatureSettingNP.apply();
                 return false;
@@ -335,6 +923,31 @@ bool Focap::ISNewNumber(const char *dev, const char *name, double values[], char
             TemperatureSettingNP.apply();
             return true;
         }
+        if (MotorCurrentNP.isNameMatch(name) && firmwareVersion >= CURRENTS_FIRMWARE)
+        {
+            MotorCurrentNP.update(values, names, n);
+            bool rc = setMotorCurrents();
+            MotorCurrentNP.setState(rc ? IPS_OK : IPS_ALERT);
+            MotorCurrentNP.apply();
+            return rc;
+        }
+        if (FocusSampleNP.isNameMatch(name))
+        {
+            FocusSampleNP.update(values, names, n);
+            addFocusSample(FocusSampleNP[SampleTemperature].getValue(), FocusSampleNP[SamplePosition].getValue());
+            FocusSampleNP.setState(IPS_OK);
+            FocusSampleNP.apply();
+            return true;
+        }
+        if (DeviceCountNP.isNameMatch(name))
+        {
+            DeviceCountNP.update(values, names, n);
+            DeviceCountNP.setState(IPS_OK);
+            DeviceCountNP.apply();
+            saveConfig(true, DeviceCountNP.getName());
+            LOGF_INFO("Driver will manage %.0f units after restart.", DeviceCountNP[0].getValue());
+            return true;
+        }
     }
     return INDI::DefaultDevice::ISNewNumber(dev, name, values, names, n);
 }
@@ -343,10 +956,55 @@ bool Focap::ISNewText(const char *dev, const char *name, char *texts[], char *na
 {
     if (dev != nullptr && strcmp(dev, getDeviceName()) == 0)
     {
+        if (trace.isOpen())
+        {
+            std::vector<std::string> text(texts, texts + n);
+            trace.property('T', name, names, text.data(), n);
+        }
+
+        publisher.forget();
+
         if (LI::processText(dev, name, texts, names, n))
         {
             return true;
         }
+        if (UnitTP.isNameMatch(name))
+        {
+            UnitTP.update(texts, names, n);
+            UnitTP.setState(IPS_OK);
+            UnitTP.apply();
+            saveConfig(true, UnitTP.getName());
+            return true;
+        }
+        if (SequenceTP.isNameMatch(name))
+        {
+            SequenceTP.update(texts, names, n);
+            bool rc = loadSequence(SequenceTP[0].getText() ? SequenceTP[0].getText() : "");
+            SequenceTP.setState(rc ? IPS_OK : IPS_ALERT);
+            SequenceTP.apply();
+            return true;
+        }
+        if (TelemetryTP.isNameMatch(name))
+        {
+            TelemetryTP.update(texts, names, n);
+            TelemetryTP.setState(IPS_OK);
+            TelemetryTP.apply();
+            if (telemetry.isOpen())
+                setTelemetry(true);
+            return true;
+        }
+        if (TraceTP.isNameMatch(name))
+        {
+            TraceTP.update(texts, names, n);
+            TraceTP.setState(IPS_OK);
+            TraceTP.apply();
+            if (trace.isOpen())
+            {
+                trace.close();
+                setTrace(true);
+            }
+            return true;
+        }
     }
 
     return INDI::DefaultDevice::ISNewText(dev, name, texts, names, n);
@@ -356,6 +1014,24 @@ bool Focap::ISNewSwitch(const char *dev, const char *name, ISState *states, char
 {
     if (dev != nullptr && strcmp(dev, getDeviceName()) == 0)
     {
+        if (trace.isOpen())
+        {
+            std::vector<std::string> text(n);
+            for (int i = 0; i < n; i++)
+                text[i] = (states[i] == ISS_ON) ? "On" : "Off";
+            trace.property('S', name, names, text.data(), n);
+        }
+
+        publisher.forget();
+
+        // Handled by the serial plugin, only remembered for reconnects
+        if (!strcmp(name, "DEVICE_AUTO_SEARCH"))
+        {
+            for (int i = 0; i < n; i++)
+                if (!strcmp(names[i], "INDI_ENABLED"))
+                    autoSearchWanted = states[i] == ISS_ON;
+        }
+
         if (DI::processSwitch(dev, name, states, names, n))
             return true;
 
@@ -385,79 +1061,577 @@ bool Focap::ISNewSwitch(const char *dev, const char *name, ISState *states, char
             TemperatureCompensateSP.apply();
             return true;
         }
-    }
 
-    return INDI::DefaultDevice::ISNewSwitch(dev, name, states, names, n);
-}
+        if (LoopProfileSP.isNameMatch(name))
+        {
+            LoopProfileSP.reset();
+            LoopProfileSP.setState(readLoopProfile() ? IPS_OK : IPS_ALERT);
+            LoopProfileSP.apply();
+            return true;
+        }
 
-void Focap::GetFocusParams()
-{
-    if (readPosition())
-    {
-        FocusAbsPosNP.apply();
-    }
-    if (readTemperature())
-    {
-        TemperatureNP.apply();
-    }
-    if (readTemperatureCoefficient())
-    {
-        TemperatureSettingNP.apply();
-    }
-}
-/*
-IPState Focap::MoveFocuser(FocusDirection dir, int speed, uint16_t duration)
-{
-    // either go all the way in or all the way out
-    // then use timer to stop
-    if (dir == FOCUS_INWARD)
-        MoveFocuser(0);
-    else
-        MoveFocuser(static_cast<uint32_t>(FocusMaxPosNP[0].getValue()));
+        if (IdleModeSP.isNameMatch(name) && firmwareVersion >= CURRENTS_FIRMWARE)
+        {
+            int last_index = IdleModeSP.findOnSwitchIndex();
+            IdleModeSP.update(states, names, n);
 
-    IEAddTimer(duration, &Focap::timedMoveHelper, this);
-    return IPS_BUSY;
-}
-*/
-void Focap::timedMoveHelper(void *context)
-{
-    static_cast<Focap *>(context)->timedMoveCallback();
-}
+            char cmd[RES_LENGTH] = {0};
+            snprintf(cmd, RES_LENGTH, ":SM%c#", IdleModeSP[IdleDisable].getState() == ISS_ON ? '1' : '0');
+            if (!sendCommand(cmd))
+            {
+                IdleModeSP.reset();
+                IdleModeSP[last_index].setState(ISS_ON);
+                IdleModeSP.setState(IPS_ALERT);
+                IdleModeSP.apply();
+                return false;
+            }
 
-void Focap::timedMoveCallback()
-{
-    AbortFocuser();
-    FocusAbsPosNP.setState(IPS_IDLE);
-    FocusRelPosNP.setState(IPS_IDLE);
-    FocusTimerNP.setState(IPS_IDLE);
-    FocusTimerNP[0].setValue(0);
-    FocusAbsPosNP.apply();
-    FocusRelPosNP.apply();
-    FocusTimerNP.apply();
-}
+            IdleModeSP.setState(IPS_OK);
+            IdleModeSP.apply();
+            return true;
+        }
 
-IPState Focap::MoveAbsFocuser(uint32_t targetTicks)
-{
-    targetPos = targetTicks;
+        if (HomeSP.isNameMatch(name))
+        {
+            HomeSP.update(states, names, n);
+            if (HomeSP[0].getState() != ISS_ON)
+            {
+                HomeSP.apply();
+                return true;
+            }
+            HomeSP.reset();
+            bool rc = startHoming();
+            HomeSP.setState(rc ? IPS_BUSY : IPS_ALERT);
+            HomeSP.apply();
+            return true;
+        }
 
-    if (!MoveFocuser(targetPos))
-    {
-        return IPS_ALERT;
-    }
+        if (SequenceSP.isNameMatch(name))
+        {
+            SequenceSP.update(states, names, n);
+            int index = SequenceSP.findOnSwitchIndex();
+            SequenceSP.reset();
+            if (index < 0)
+            {
+                SequenceSP.apply();
+                return true;
+            }
+            if (index == SequenceNext)
+            {
+                // nextSequenceStep() sets the switch busy until the step has arrived
+                if (!nextSequenceStep())
+                {
+                    SequenceSP.setState(IPS_ALERT);
+                    SequenceSP.apply();
+                }
+                return true;
+            }
+            sequenceNext = 0;
+            SequenceSP.setState(uploadSequence() ? IPS_OK : IPS_ALERT);
+            SequenceSP.apply();
+            return true;
+        }
+
+        if (FlatSessionSP.isNameMatch(name))
+        {
+            FlatSessionSP.update(states, names, n);
+            int index = FlatSessionSP.findOnSwitchIndex();
+            FlatSessionSP.reset();
+            if (index < 0)
+            {
+                FlatSessionSP.apply();
+                return true;
+            }
+            bool start = index == FlatsStart;
+            bool rc = start ? startFlats() : finishFlats();
+            FlatSessionSP.setState(rc ? (start ? IPS_BUSY : IPS_OK) : IPS_ALERT);
+            FlatSessionSP.apply();
+            return true;
+        }
+
+        if (CoefficientFitSP.isNameMatch(name))
+        {
+            CoefficientFitSP.update(states, names, n);
+            int index = CoefficientFitSP.findOnSwitchIndex();
+            CoefficientFitSP.reset();
+            CoefficientFitSP.setState(IPS_OK);
+
+            switch (index)
+            {
+                case FitAddCurrent:
+                    addFocusSample(TemperatureNP[0].getValue(), FocusAbsPosNP[0].getValue());
+                    break;
+                case FitApply:
+                    if (CoefficientFitNP.getState() != IPS_OK)
+                    {
+                        LOG_ERROR("No fitted coefficient to apply.");
+                        CoefficientFitSP.setState(IPS_ALERT);
+                        break;
+                    }
+                    if (!setTemperatureCoefficient(CoefficientFitNP[FitCoefficient].getValue()))
+                    {
+                        CoefficientFitSP.setState(IPS_ALERT);
+                        break;
+                    }
+                    TemperatureSettingNP[Coefficient].setValue(CoefficientFitNP[FitCoefficient].getValue());
+                    TemperatureSettingNP.apply();
+                    LOGF_INFO("Temperature coefficient set to %.2f steps/°C.", CoefficientFitNP[FitCoefficient].getValue());
+                    break;
+                case FitClear:
+                    focusSamples.clear();
+                    fitTemperatureCoefficient();
+                    break;
+            }
+
+            CoefficientFitSP.apply();
+            return true;
+        }
+
+        if (TelemetrySP.isNameMatch(name))
+        {
+            TelemetrySP.update(states, names, n);
+            bool rc = setTelemetry(TelemetrySP[INDI_ENABLED].getState() == ISS_ON);
+            TelemetrySP.setState(rc ? IPS_OK : IPS_ALERT);
+            TelemetrySP.apply();
+            return rc;
+        }
+
+        if (TraceSP.isNameMatch(name))
+        {
+            TraceSP.update(states, names, n);
+            bool rc = setTrace(TraceSP[INDI_ENABLED].getState() == ISS_ON);
+            TraceSP.setState(rc ? IPS_OK : IPS_ALERT);
+            TraceSP.apply();
+            return rc;
+        }
+    }
+
+    return INDI::DefaultDevice::ISNewSwitch(dev, name, states, names, n);
+}
+
+bool Focap::readLoopProfile()
+{
+    if (isSimulation())
+        return true;
+
+    // 18 phase values, 8 histogram counts and the step gap, 4 hex digits each
+    char res[PROFILE_LENGTH] = {0};
+    if (!sendCommand(":GL#", res, PROFILE_LENGTH))
+        return false;
+
+    const int count = LOOP_PHASES * 3 + 1 + LOOP_BUCKETS;
+    if (strlen(res) < count * 4)
+    {
+        LOGF_ERROR("Unknown error: loop profile (%s)", res);
+        return false;
+    }
+
+    unsigned int values[count] = {0};
+    for (int i = 0; i < count; i++)
+        sscanf(res + i * 4, "%4x", &values[i]);
+
+    for (int i = 0; i < LOOP_PHASES * 3; i++)
+        LoopTimingNP[i].setValue(values[i]);
+    LoopTimingNP[LOOP_PHASES * 3].setValue(values[count - 1]);
+    for (int i = 0; i < LOOP_BUCKETS; i++)
+        LoopHistogramNP[i].setValue(values[LOOP_PHASES * 3 + i]);
+
+    LoopTimingNP.setState(IPS_OK);
+    LoopTimingNP.apply();
+    LoopHistogramNP.setState(IPS_OK);
+    LoopHistogramNP.apply();
+
+    return true;
+}
+
+bool Focap::getMotorCurrents()
+{
+    if (isSimulation())
+        return true;
+
+    char res[RES_LENGTH] = {0};
+    if (sendCommand(":GH#", res) == false)
+        return false;
+
+    unsigned int run = 0, hold = 0, delay = 0, powerDown = 0, mode = 0;
+    if (sscanf(res, "%4x%2x%2x%2x%1u", &run, &hold, &delay, &powerDown, &mode) != 5)
+    {
+        LOGF_ERROR("Unknown error: motor current values (%s)", res);
+        return false;
+    }
+
+    MotorCurrentNP[RunCurrent].setValue(run);
+    MotorCurrentNP[HoldCurrent].setValue(hold);
+    MotorCurrentNP[HoldDelay].setValue(delay);
+    MotorCurrentNP[PowerDown].setValue(powerDown * POWER_DOWN_MS);
+    MotorCurrentNP.setState(IPS_OK);
+    MotorCurrentNP.apply();
+
+    IdleModeSP.reset();
+    IdleModeSP[mode ? IdleDisable : IdleHold].setState(ISS_ON);
+    IdleModeSP.setState(IPS_OK);
+    IdleModeSP.apply();
+
+    return true;
+}
+
+// Sends currents and idle mode again if the unit came back with others, EEPROM writes only when needed
+void Focap::restoreMotorCurrents()
+{
+    std::vector<double> wanted;
+    for (size_t i = 0; i < MotorCurrentNP.size(); i++)
+        wanted.push_back(MotorCurrentNP[i].getValue());
+    int mode = IdleModeSP.findOnSwitchIndex();
+
+    if (!getMotorCurrents())
+        return;
+
+    bool changed = false;
+    for (size_t i = 0; i < MotorCurrentNP.size(); i++)
+        changed |= std::fabs(MotorCurrentNP[i].getValue() - wanted[i]) > (i == PowerDown ? POWER_DOWN_MS / 2 : 0.5);
+    if (changed)
+    {
+        LOG_WARN("Motor currents were reset, restoring them.");
+        for (size_t i = 0; i < MotorCurrentNP.size(); i++)
+            MotorCurrentNP[i].setValue(wanted[i]);
+        MotorCurrentNP.setState(setMotorCurrents() ? IPS_OK : IPS_ALERT);
+        MotorCurrentNP.apply();
+    }
+
+    if (mode >= 0 && IdleModeSP.findOnSwitchIndex() != mode)
+    {
+        LOG_WARN("Idle mode was reset, restoring it.");
+        char cmd[RES_LENGTH] = {0};
+        snprintf(cmd, RES_LENGTH, ":SM%c#", mode == IdleDisable ? '1' : '0');
+        IdleModeSP.reset();
+        IdleModeSP[mode].setState(ISS_ON);
+        IdleModeSP.setState(sendCommand(cmd) ? IPS_OK : IPS_ALERT);
+        IdleModeSP.apply();
+    }
+}
+
+bool Focap::setMotorCurrents()
+{
+    char cmd[RES_LENGTH] = {0};
+
+    snprintf(cmd, RES_LENGTH, ":SR%04x#", static_cast<uint16_t>(MotorCurrentNP[RunCurrent].getValue()));
+    if (!sendCommand(cmd))
+        return false;
+
+    snprintf(cmd, RES_LENGTH, ":SH%02x#", static_cast<uint8_t>(MotorCurrentNP[HoldCurrent].getValue()));
+    if (!sendCommand(cmd))
+        return false;
+
+    snprintf(cmd, RES_LENGTH, ":SD%02x#", static_cast<uint8_t>(MotorCurrentNP[HoldDelay].getValue()));
+    if (!sendCommand(cmd))
+        return false;
+
+    // TPOWERDOWN counts in units of 2^18 clocks of the 12 MHz internal oscillator
+    snprintf(cmd, RES_LENGTH, ":SW%02x#", static_cast<uint8_t>(std::min(254.0, round(MotorCurrentNP[PowerDown].getValue() / POWER_DOWN_MS))));
+    return sendCommand(cmd);
+}
+
+void Focap::GetFocusParams()
+{
+    if (readPosition())
+    {
+        FocusAbsPosNP.apply();
+    }
+    if (readTemperature())
+    {
+        TemperatureNP.apply();
+    }
+    if (readTemperatureCoefficient())
+    {
+        TemperatureSettingNP.apply();
+    }
+}
+// The firmware times the move and decelerates at the end, speed is fixed
+IPState Focap::MoveFocuser(FocusDirection dir, int speed, uint16_t duration)
+{
+    INDI_UNUSED(speed);
+
+    if (firmwareVersion < NATIVE_MOVE_FIRMWARE)
+        return IPS_ALERT;
+
+    char cmd[RES_LENGTH] = {0};
+    snprintf(cmd, RES_LENGTH, ":MT%c%04x#", dir == FOCUS_INWARD ? '0' : '1', duration);
+    if (!sendCommand(cmd))
+        return IPS_ALERT;
+
+    timedMoveEnd = hostTime() + duration / 1000.0;
+    targetPos = (dir == FOCUS_INWARD) ? 0 : static_cast<uint32_t>(FocusMaxPosNP[0].getValue());
+    FocusAbsPosNP.setState(IPS_BUSY);
+    FocusAbsPosNP.apply();
+    return IPS_BUSY;
+}
+
+// Counts FOCUS_TIMER down while a timed move runs and settles it once the focuser has stopped
+void Focap::updateTimedMove(bool moving)
+{
+    if (FocusTimerNP.getState() != IPS_BUSY)
+        return;
+
+    if (!moving)
+    {
+        FocusTimerNP[0].setValue(0);
+        FocusTimerNP.setState(IPS_OK);
+    }
+    else
+        FocusTimerNP[0].setValue(std::max(0.0, (timedMoveEnd - hostTime()) * 1000));
+    publish(FocusTimerNP, TIMER_DEADBAND);
+}
+
+bool Focap::startHoming()
+{
+    if (!sendCommand(":PH#"))
+        return false;
+
+    homeState = 0;
+    LOG_INFO("Homing focuser against the inner stop...");
+    return true;
+}
+
+/*
+Follows the firmware through the homing phases. Once it reports idle the fault code says whether
+it found the stop; the position it reports from then on is relative to the stop.
+*/
+void Focap::updateHoming()
+{
+    static const char *phases[] = { "Idle", "Fast approach", "Backing off", "Slow approach", "Moving off the stop" };
+
+    char response[RES_LENGTH] = {0};
+    int state = 0;
+    if (!isSimulation() && (!sendCommand(":GZ#", response) || sscanf(response, "%x", &state) != 1 || state > 4))
+        return;
+
+    if (state != 0)
+    {
+        if (state != homeState)
+            LOGF_DEBUG("Homing: %s.", phases[state]);
+        homeState = state;
+        IUSaveText(&StatusT[2], (std::string("Homing: ") + phases[state]).c_str());
+        publish(StatusTP);
+        return;
+    }
+
+    // The fault from this poll's status may predate the end of homing, ask again now that it's idle
+    unsigned int fault = 0;
+    if (!isSimulation())
+    {
+        if (!sendCommand(":GF#", response) || sscanf(response, "%x", &fault) != 1)
+            return;
+        focuserFault = fault;
+    }
+
+    homeState = 0;
+    if (focuserFault == FAULT_HOME)
+    {
+        LOG_ERROR("Homing failed, no stop found within the travel.");
+        HomeSP.setState(IPS_ALERT);
+    }
+    else if (focuserFault != NO_FAULT)
+    {
+        LOGF_ERROR("Homing failed: %s.", faultName(focuserFault));
+        HomeSP.setState(IPS_ALERT);
+    }
+    else
+    {
+        LOG_INFO("Focuser homed, position 0 is at the inner stop.");
+        HomeSP.setState(IPS_OK);
+    }
+    HomeSP.apply();
+}
+
+/*
+Takes absolute positions separated by commas or spaces, checks them against the travel and
+uploads them. An empty list clears the sequence.
+*/
+bool Focap::loadSequence(const char *text)
+{
+    std::vector<uint32_t> targets;
+    const char *p = text;
+    while (*p)
+    {
+        if (strchr(",; \t\r\n", *p))
+        {
+            p++;
+            continue;
+        }
+        char *end = nullptr;
+        long value = strtol(p, &end, 10);
+        if (end == p || value < 0 || value > FocusMaxPosNP[0].getValue())
+        {
+            LOGF_ERROR("Invalid sequence target at \"%s\".", p);
+            return false;
+        }
+        targets.push_back(static_cast<uint32_t>(value));
+        p = end;
+    }
+    if (targets.size() > MAX_SEQUENCE_STEPS)
+    {
+        LOGF_ERROR("A sequence holds at most %zu targets, got %zu.", MAX_SEQUENCE_STEPS, targets.size());
+        return false;
+    }
+
+    sequenceTargets = targets;
+    sequenceNext = 0;
+    if (!uploadSequence())
+        return false;
+    if (!targets.empty())
+        LOGF_INFO("Focus sequence of %zu targets loaded.", targets.size());
+    return true;
+}
+
+// Sends the approach and the steps from sequenceNext on, the firmware numbers them from 0
+bool Focap::uploadSequence()
+{
+    char cmd[RES_LENGTH] = {0}, res[RES_LENGTH] = {0};
+    int overshoot = static_cast<int>(SequenceApproachNP[0].getValue());
+    snprintf(cmd, RES_LENGTH, ":QB%s%x#", overshoot < 0 ? "-" : "", std::abs(overshoot));
+    if (!sendCommand(":QC#") || !sendCommand(cmd))
+        return false;
+
+    sequenceFirst = sequenceNext;
+    for (size_t i = sequenceFirst; i < sequenceTargets.size(); i++)
+    {
+        snprintf(cmd, RES_LENGTH, ":QA%08x#", sequenceTargets[i]);
+        unsigned int count = 0;
+        if (!sendCommand(cmd, res) || sscanf(res, "%2x", &count) != 1 || count != i - sequenceFirst + 1)
+        {
+            LOGF_ERROR("Unable to upload sequence target %u (%s).", sequenceTargets[i], res);
+            return false;
+        }
+    }
+
+    updateSequenceState();
+    return true;
+}
+
+bool Focap::nextSequenceStep()
+{
+    char res[RES_LENGTH] = {0};
+    unsigned int index = 0;
+    uint32_t target = 0;
+    if (!sendCommand(":QN#", res) || sscanf(res, "%2x%8x", &index, &target) != 2)
+        return false;
+    if (index == 0xff)
+    {
+        LOG_WARN("Focus sequence has no steps left, restart or load a new one.");
+        return false;
+    }
+
+    sequenceNext = sequenceFirst + index + 1;
+    targetPos = target;
+    LOGF_DEBUG("Sequence step %zu of %zu, moving to %u.", sequenceNext, sequenceTargets.size(), target);
+
+    FocusAbsPosNP.setState(IPS_BUSY);
+    FocusAbsPosNP.apply();
+    SequenceSP.setState(IPS_BUSY);
+    SequenceSP.apply();
+    updateSequenceState();
+    return true;
+}
+
+/*
+The sequence only lives in the unit's RAM, a reset unit gets the steps that are left again. A
+trigger input advances the sequence without the driver, so the next step is taken from the unit.
+*/
+void Focap::checkSequence()
+{
+    if (sequenceTargets.empty())
+        return;
+
+    char res[RES_LENGTH] = {0};
+    unsigned int next = 0, count = 0;
+    if (!sendCommand(":GQ#", res) || sscanf(res, "%2x%2x", &next, &count) != 2)
+        return;
+    if (count != sequenceTargets.size() - sequenceFirst)
+    {
+        LOGF_WARN("Focus sequence was lost, uploading the remaining %zu steps.", sequenceTargets.size() - sequenceNext);
+        uploadSequence();
+    }
+    else if (sequenceFirst + next != sequenceNext)
+    {
+        sequenceNext = sequenceFirst + next;
+        updateSequenceState();
+    }
+}
+
+void Focap::updateSequenceState()
+{
+    SequenceStateNP[SequenceStep].setValue(sequenceNext);
+    SequenceStateNP[SequenceSteps].setValue(sequenceTargets.size());
+    SequenceStateNP.setState(sequenceTargets.empty() ? IPS_IDLE : IPS_OK);
+    SequenceStateNP.apply();
+}
+
+bool Focap::SetFocuserMaxPosition(uint32_t ticks)
+{
+    if (firmwareVersion < NATIVE_MOVE_FIRMWARE)
+        return true;
+
+    char cmd[RES_LENGTH] = {0};
+    snprintf(cmd, RES_LENGTH, ":SL%08x#", ticks);
+    return sendCommand(cmd);
+}
+
+IPState Focap::MoveAbsFocuser(uint32_t targetTicks)
+{
+    // Clients stepping through the uploaded targets get the firmware's approach for the same command
+    if (firmwareVersion >= SEQUENCE_FIRMWARE && !sequenceTargets.empty())
+    {
+        checkSequence();
+        if (sequenceNext < sequenceTargets.size() && sequenceTargets[sequenceNext] == targetTicks)
+        {
+            if (!nextSequenceStep())
+                return IPS_ALERT;
+            if (targetPos == targetTicks)
+                return IPS_BUSY;
+
+            // Triggered in between, the plain move below replaces the step
+            LOGF_WARN("Focus sequence moved on to %u, moving to %u directly.", targetPos, targetTicks);
+        }
+    }
+
+    targetPos = targetTicks;
+
+    if (!MoveFocuser(targetPos))
+    {
+        return IPS_ALERT;
+    }
 
     return IPS_BUSY;
 }
 
 IPState Focap::MoveRelFocuser(FocusDirection dir, uint32_t ticks)
 {
-    // Clamp
     int32_t offset = ((dir == FOCUS_INWARD) ? -1 : 1) * static_cast<int32_t>(ticks);
+
+    // Relative to where the motor is rather than to the last position read, the firmware clamps
+    if (firmwareVersion >= NATIVE_MOVE_FIRMWARE)
+    {
+        char cmd[RES_LENGTH] = {0}, res[RES_LENGTH] = {0};
+        snprintf(cmd, RES_LENGTH, ":MR%s%x#", offset < 0 ? "-" : "", ticks);
+        uint32_t target = 0;
+        if (!sendCommand(cmd, res) || sscanf(res, "%8x", &target) != 1)
+            return IPS_ALERT;
+
+        targetPos = target;
+        FocusRelPosNP[0].setValue(ticks);
+        FocusRelPosNP.setState(IPS_BUSY);
+        return IPS_BUSY;
+    }
+
+    // Clamp
     int32_t newPosition = FocusAbsPosNP[0].getValue() + offset;
     newPosition = std::max(static_cast<int32_t>(FocusAbsPosNP[0].getMin()), std::min(static_cast<int32_t>(FocusAbsPosNP[0].getMax()), newPosition));
 
     if (!MoveFocuser(newPosition))
         return IPS_ALERT;
 
+    targetPos = newPosition;
+
     FocusRelPosNP[0].setValue(ticks);
     FocusRelPosNP.setState(IPS_BUSY);
 
@@ -475,6 +1649,17 @@ bool Focap::saveConfigItems(FILE *fp)
 {
     INDI::DefaultDevice::saveConfigItems(fp);
 
+    if (deviceIndex == 0)
+        DeviceCountNP.save(fp);
+
+    UnitTP.save(fp);
+    TelemetrySP.save(fp);
+    TelemetryTP.save(fp);
+    TraceSP.save(fp);
+    TraceTP.save(fp);
+    PublishNP.save(fp);
+    SequenceApproachNP.save(fp);
+
     return LI::saveConfigItems(fp) && FI::saveConfigItems(fp);
 }
 
@@ -491,38 +1676,213 @@ bool Focap::getStartupData()
     bool rc3 = getBrightness();
     bool rc4 = getParkAngle();
     bool rc5 = getUnparkAngle();
+    bool rc6 = (firmwareVersion >= SERVO_PROFILE_FIRMWARE) ? getServoProfile() : true;
 
-    return (rc1 && rc2 && rc3 && rc4 && rc5);
+    return (rc1 && rc2 && rc3 && rc4 && rc5 && rc6);
 }
 
 IPState Focap::ParkCap()
 {
+    flatsPending = false;
+
     if (isSimulation())
     {
-        simulationWorkCounter = 3;
-        return IPS_BUSY;
+        simulationWorkCounter = 3;
+        return IPS_BUSY;
+    }
+
+    char response[RES_LENGTH];
+    if (!sendCommand(">C000#", response))
+        return IPS_ALERT;
+
+    scheduleCoverTimeout(true);
+    return IPS_BUSY;
+}
+
+IPState Focap::UnParkCap()
+{
+    flatsPending = false;
+
+    if (isSimulation())
+    {
+        simulationWorkCounter = 3;
+        return IPS_BUSY;
+    }
+
+    char response[RES_LENGTH];
+    if (!sendCommand(">O000#", response))
+        return IPS_ALERT;
+
+    scheduleCoverTimeout(false);
+    return IPS_BUSY;
+}
+
+/*
+Time the firmware needs to sweep between park and unpark angle with its trapezoidal profile.
+Moves too short to reach cruise speed are a triangle: accelerate half way, decelerate the rest.
+*/
+double Focap::coverMoveTime()
+{
+    double distance = fabs(AnglesN[1].value - AnglesN[0].value);
+
+    // Older firmware steps the servo 1° every 20 ms
+    if (firmwareVersion < SERVO_PROFILE_FIRMWARE)
+        return distance / 50.0;
+
+    double speed = ServoProfileNP[ServoSpeed].getValue();
+    double acceleration = ServoProfileNP[ServoAcceleration].getValue();
+
+    if (speed <= 0 || acceleration <= 0)
+        return FLAT_TIMEOUT;
+
+    if (distance < speed * speed / acceleration)
+        return 2 * sqrt(distance / acceleration);
+
+    return distance / speed + speed / acceleration;
+}
+
+void Focap::scheduleCoverTimeout(bool park)
+{
+    cancelCoverTimeout();
+
+    // Generous margin over the profile, the servo may be loaded or the cover stiff in the cold
+    int deadline = static_cast<int>((coverMoveTime() * 1.5 + COVER_TIMEOUT_MARGIN) * 1000);
+    if (park)
+        parkTimeoutID = IEAddTimer(deadline, &Focap::parkTimeoutHelper, this);
+    else
+        unparkTimeoutID = IEAddTimer(deadline, &Focap::unparkTimeoutHelper, this);
+}
+
+void Focap::cancelCoverTimeout()
+{
+    if (parkTimeoutID >= 0)
+    {
+        IERmTimer(parkTimeoutID);
+        parkTimeoutID = -1;
+    }
+    if (unparkTimeoutID >= 0)
+    {
+        IERmTimer(unparkTimeoutID);
+        unparkTimeoutID = -1;
+    }
+}
+
+/*
+Parks the cover, sets the brightness and switches the light on in a single command. The status
+reply reports the light as waiting until the cover is parked and the light is on.
+*/
+bool Focap::startFlats()
+{
+    bool parked = ParkCapSP[0].getState() == ISS_ON && ParkCapSP.getState() == IPS_OK;
+
+    if (!isSimulation())
+    {
+        char command[FLAT_CMD];
+        char response[RES_LENGTH];
+        snprintf(command, FLAT_CMD, ">F%03d#", static_cast<int>(LightIntensityNP[0].getValue()));
+        if (!sendCommand(command, response))
+            return false;
+    }
+    else if (!parked)
+        simulationWorkCounter = 3;
+
+    flatsPending = true;
+    flatsReadyTime = hostTime() + (parked ? 0 : coverMoveTime());
+    if (!parked)
+    {
+        ParkCapSP.reset();
+        ParkCapSP[0].setState(ISS_ON);
+        ParkCapSP.setState(IPS_BUSY);
+        ParkCapSP.apply();
+        scheduleCoverTimeout(true);
+    }
+
+    LOG_INFO("Closing cover for flats.");
+    return true;
+}
+
+// Switches the light off and opens the cover in a single command
+bool Focap::finishFlats()
+{
+    flatsPending = false;
+
+    if (!isSimulation())
+    {
+        char response[RES_LENGTH];
+        if (!sendCommand(">E000#", response))
+            return false;
+    }
+    else
+        simulationWorkCounter = 3;
+
+    LightSP.reset();
+    LightSP[FLAT_LIGHT_OFF].setState(ISS_ON);
+    LightSP.setState(IPS_IDLE);
+    LightSP.apply();
+
+    ParkCapSP.reset();
+    ParkCapSP[1].setState(ISS_ON);
+    ParkCapSP.setState(IPS_BUSY);
+    ParkCapSP.apply();
+    scheduleCoverTimeout(false);
+
+    LOG_INFO("Flats finished, opening cover.");
+    return true;
+}
+
+bool Focap::getServoProfile()
+{
+    if (isSimulation())
+    {
+        return true;
+    }
+
+    char response[RES_LENGTH];
+    int speed = 0, acceleration = 0;
+
+    if (!sendCommand(">Y000#", response) || sscanf(response, "*Y%d", &speed) <= 0)
+    {
+        LOGF_ERROR("Unable to read servo speed (%s)", response);
+        return false;
+    }
+    if (!sendCommand(">U000#", response) || sscanf(response, "*U%d", &acceleration) <= 0)
+    {
+        LOGF_ERROR("Unable to read servo acceleration (%s)", response);
+        return false;
     }
 
-    char response[RES_LENGTH];
-    if(sendCommand(">C000#", response))
-        return IPS_BUSY;
-    else
-        return IPS_ALERT;
+    ServoProfileNP[ServoSpeed].setValue(speed);
+    ServoProfileNP[ServoAcceleration].setValue(acceleration);
+    ServoProfileNP.setState(IPS_OK);
+    ServoProfileNP.apply();
+
+    return true;
 }
 
-IPState Focap::UnParkCap()
+bool Focap::setServoProfile(uint16_t speed, uint16_t acceleration)
 {
     if (isSimulation())
     {
-        simulationWorkCounter = 3;
-        return IPS_BUSY;
+        ServoProfileNP[ServoSpeed].setValue(speed);
+        ServoProfileNP[ServoAcceleration].setValue(acceleration);
+        return true;
     }
 
+    char command[FLAT_CMD];
     char response[RES_LENGTH];
-    if(sendCommand(">O000#", response))
-        return IPS_BUSY;
-    else
-        return IPS_ALERT;
+    int value = 0;
+
+    snprintf(command, FLAT_CMD, ">W%03d#", speed);
+    if (!sendCommand(command, response) || sscanf(response, "*W%d", &value) <= 0)
+        return false;
+    ServoProfileNP[ServoSpeed].setValue(value);
+
+    snprintf(command, FLAT_CMD, ">X%03d#", acceleration);
+    if (!sendCommand(command, response) || sscanf(response, "*X%d", &value) <= 0)
+        return false;
+    ServoProfileNP[ServoAcceleration].setValue(value);
+
+    return true;
 }
 
 bool Focap::setParkAngle(uint16_t value)
@@ -649,11 +2009,17 @@ bool Focap::getUnparkAngle()
 
 bool Focap::EnableLightBox(bool enable)
 {
+    if (!enable)
+        flatsPending = false;
+
     if (ParkCapSP[1].getState() == ISS_ON)
     {
         if(!enable) {
             return true;
         }
+        // Newer firmware closes the cover itself and switches the light on once it's parked
+        if (firmwareVersion >= FLATS_FIRMWARE)
+            return startFlats();
         LOG_ERROR("Cannot control light while cap is unparked.");
         return false;
     }
@@ -667,7 +2033,7 @@ bool Focap::EnableLightBox(bool enable)
 
 bool Focap::getStatus()
 {
-    char response[RES_LENGTH];
+    char response[RES_LENGTH] = {0};
 
     if (isSimulation())
     {
@@ -711,7 +2077,27 @@ bool Focap::getStatus()
     char lightStatus = *(response + 3) - '0';
     char coverStatus = *(response + 4) - '0';
 
-    if (focuserStatus)
+    // Older firmware has no fault field
+    char faultStatus = (response[5] >= '0' && response[5] <= '9') ? response[5] - '0' : 0;
+
+    focuserState = focuserStatus;
+    focuserFault = faultStatus;
+    lightState = lightStatus;
+    coverState = coverStatus;
+
+    if (faultStatus)
+    {
+        IUSaveText(&StatusT[2], faultName(faultStatus));
+        if (FocusAbsPosNP.getState() == IPS_BUSY || FocusRelPosNP.getState() == IPS_BUSY)
+        {
+            LOGF_ERROR("Focuser move aborted by firmware: %s.", faultName(faultStatus));
+            FocusAbsPosNP.setState(IPS_ALERT);
+            FocusRelPosNP.setState(IPS_ALERT);
+            FocusAbsPosNP.apply();
+            FocusRelPosNP.apply();
+        }
+    }
+    else if (focuserStatus)
     {
         IUSaveText(&StatusT[2], "Moving");
     }
@@ -724,6 +2110,8 @@ bool Focap::getStatus()
     {
     case 0:
         IUSaveText(&StatusT[0], "Parked");
+        cancelCoverTimeout();
+        coverRetries = 0;
         if (ParkCapSP.getState() == IPS_BUSY || ParkCapSP.getState() == IPS_IDLE)
         {
             ParkCapSP.reset();
@@ -735,6 +2123,8 @@ bool Focap::getStatus()
         break;
     case 1:
         IUSaveText(&StatusT[0], "Unparked");
+        cancelCoverTimeout();
+        coverRetries = 0;
         if (ParkCapSP.getState() == IPS_BUSY || ParkCapSP.getState() == IPS_IDLE)
         {
             ParkCapSP.reset();
@@ -769,26 +2159,61 @@ bool Focap::getStatus()
         break;
     }
 
-    if (lightStatus)
+    if (lightStatus == 2)
+    {
+        IUSaveText(&StatusT[1], "Waiting for cover");
+        LightSP[0].setState(ISS_ON);
+        LightSP[1].setState(ISS_OFF);
+        LightSP.setState(IPS_BUSY);
+        publish(LightSP);
+    }
+    else if (lightStatus)
     {
         IUSaveText(&StatusT[1], "On");
         LightSP[0].setState(ISS_ON);
         LightSP[1].setState(ISS_OFF);
-        LightSP.apply();
+        if (flatsPending)
+        {
+            flatsPending = false;
+            LOG_INFO("Ready for flats.");
+            LightSP.setState(IPS_OK);
+            FlatSessionSP.setState(IPS_OK);
+            FlatSessionSP.apply();
+        }
+        publish(LightSP);
     }
     else
     {
         IUSaveText(&StatusT[1], "Off");
         LightSP[1].setState(ISS_ON);
         LightSP[0].setState(ISS_OFF);
-        LightSP.apply();
+        if (LightSP.getState() == IPS_BUSY)
+            LightSP.setState(IPS_IDLE);
+        publish(LightSP);
     }
 
-    IDSetText(&StatusTP, nullptr);
+    publish(StatusTP);
 
     return true;
 }
 
+const char *Focap::faultName(uint8_t fault)
+{
+    switch (fault)
+    {
+        case FAULT_SLIP:
+            return "Slipped";
+        case FAULT_STALL:
+            return "Stalled";
+        case FAULT_ENCODER:
+            return "Encoder error";
+        case FAULT_HOME:
+            return "No stop found";
+        default:
+            return "Fault";
+    }
+}
+
 bool Focap::getFirmwareVersion()
 {
     if (isSimulation())
@@ -807,6 +2232,7 @@ bool Focap::getFirmwareVersion()
     char versionString[4] = {0};
     snprintf(versionString, 4, "%s", response + 2);
     IUSaveText(&FirmwareT[0], versionString);
+    firmwareVersion = atoi(versionString);
     IDSetText(&FirmwareTP, nullptr);
 
     return true;
@@ -819,51 +2245,449 @@ void Focap::TimerHit()
         return;
     }
 
-    getStatus();
-
-    // parking or unparking timed out, try again
-    if (ParkCapSP.getState() == IPS_BUSY && !strcmp(StatusT[0].text, "Timed out"))
+    if (linkLost)
     {
-        if (ParkCapSP[0].getState() == ISS_ON)
-            ParkCap();
-        else
-            UnParkCap();
+        if (!reconnect())
+        {
+            SetTimer(reconnectDelay);
+            reconnectDelay = std::min(reconnectDelay * 2, RECONNECT_MAX_DELAY);
+            return;
+        }
+        resync();
     }
 
-    bool rc = readPosition();
-    if (rc)
+    // A unit that does not answer costs the shared event loop one timeout per poll, not one per command
+    if (!getStatus())
     {
-        if (fabs(lastPos - FocusAbsPosNP[0].getValue()) > 5)
+        if (linkFailures >= LINK_FAILURE_LIMIT && !isSimulation())
         {
-            FocusAbsPosNP.apply();
-            lastPos = static_cast<uint32_t>(FocusAbsPosNP[0].getValue());
+            LOG_WARN("Lost the link to the Focap, reconnecting in the background...");
+            linkLost = true;
+            PortFD = -1;
+            reconnectDelay = RECONNECT_MIN_DELAY;
+            IUSaveText(&StatusT[0], "Link lost");
+            StatusTP.s = IPS_ALERT;
+            publish(StatusTP);
+            SetTimer(reconnectDelay);
+            return;
         }
+        SetTimer(getCurrentPollingPeriod());
+        return;
     }
 
-    rc = readTemperature();
-    if (rc)
+    // parking or unparking timed out, try again
+    if (ParkCapSP.getState() == IPS_BUSY && !strcmp(StatusT[0].text, "Timed out"))
     {
-        if (std::abs(lastTemperature - TemperatureNP[0].getValue()) >= 0.5)
-        {
-            TemperatureNP.apply();
-            lastTemperature = static_cast<uint32_t>(TemperatureNP[0].getValue());
-        }
+        if (ParkCapSP[0].getState() != ISS_ON)
+            UnParkCap();
+        else if (flatsPending)
+            startFlats();
+        else
+            ParkCap();
     }
 
+    if (HomeSP.getState() == IPS_BUSY)
+        updateHoming();
+
+    if (firmwareVersion >= TIMESTAMP_FIRMWARE && hostTime() - lastClockSync >= CLOCK_SYNC_INTERVAL)
+        syncClock();
+
+    bool hasMotion = firmwareVersion >= MOTION_FIRMWARE;
+    bool rc = hasMotion ? readMotion() : readPosition();
+    bool positionSent = rc && publish(FocusAbsPosNP, PublishNP[PositionDeadband].getValue());
+
+    rc = readTemperature();
+    bool temperatureSent = rc && publish(TemperatureNP, PublishNP[TemperatureDeadband].getValue());
+
+    if (firmwareVersion >= TIMESTAMP_FIRMWARE)
+        publishSampleTimes(positionSent, temperatureSent);
+
+    uint32_t period = getCurrentPollingPeriod();
+
     if (FocusAbsPosNP.getState() == IPS_BUSY || FocusRelPosNP.getState() == IPS_BUSY)
     {
-        if (!isMoving())
+        // Newer firmware already told us in the status reply, no need for :GI#
+        if (!(hasMotion ? focuserState : isMoving()))
         {
             FocusAbsPosNP.setState(IPS_OK);
             FocusRelPosNP.setState(IPS_OK);
-            FocusAbsPosNP.apply();
+            publish(FocusAbsPosNP, 0, true);
             FocusRelPosNP.apply();
-            lastPos = static_cast<uint32_t>(FocusAbsPosNP[0].getValue());
             LOG_INFO("Focuser reached requested position.");
+            setEta(0);
+            updateTimedMove(false);
+        }
+        else if (hasMotion)
+        {
+            // Poll again right when the move should be done instead of up to a period later
+            double remaining = motion.arrivalTime() - hostTime();
+            if (FocusTimerNP.getState() == IPS_BUSY)
+                remaining = std::min(remaining, timedMoveEnd - hostTime());
+            updateTimedMove(true);
+            setEta(remaining);
+            if (remaining * 1000 < period)
+                period = std::max(MIN_POLL_PERIOD, static_cast<uint32_t>(remaining * 1000) + ARRIVAL_MARGIN);
+            startExtrapolation();
         }
     }
 
-    SetTimer(getCurrentPollingPeriod());
+    // The client waiting for a sequence step can expose as soon as this goes out
+    if (SequenceSP.getState() == IPS_BUSY && FocusAbsPosNP.getState() != IPS_BUSY)
+    {
+        SequenceSP.setState(FocusAbsPosNP.getState());
+        SequenceSP.apply();
+    }
+
+    // Poll right when the cover should be parked, flats can start the moment the light is on
+    if (flatsPending)
+    {
+        double remaining = flatsReadyTime - hostTime();
+        if (remaining > 0 && remaining * 1000 < period)
+            period = std::max(MIN_POLL_PERIOD, static_cast<uint32_t>(remaining * 1000) + ARRIVAL_MARGIN);
+    }
+
+    if (telemetry.isOpen())
+        recordTelemetry();
+
+    if (hostTime() - lastStatsTime >= STATS_INTERVAL)
+        publishStats();
+
+    SetTimer(period);
+}
+
+double Focap::hostTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool Focap::readMotion()
+{
+    char res[RES_LENGTH] = {0};
+
+    if (sendCommand(":GM#", res) == false)
+        return false;
+
+    uint32_t position = 0, target = 0;
+    unsigned int speed = 0, maxSpeed = 0, acceleration = 0;
+    if (sscanf(res, "%8x%8x%4x%4x%4x", &position, &target, &speed, &maxSpeed, &acceleration) != 5)
+    {
+        LOGF_ERROR("Unknown error: focuser motion values (%s)", res);
+        return false;
+    }
+
+    MotionModel::Sample sample;
+    sample.position = static_cast<int32_t>(position);
+    sample.target = static_cast<int32_t>(target);
+    sample.speed = static_cast<int16_t>(speed) / 16.0;
+    sample.maxSpeed = maxSpeed / 16.0;
+    sample.acceleration = acceleration / 16.0;
+    positionTime = sampleTime(res);
+    motion.update(sample, positionTime);
+
+    FocusAbsPosNP[0].setValue(sample.position);
+    return true;
+}
+
+/*
+Turns on reply timestamps and measures the device clock from scratch, the offset is known after
+the first exchange, drift only once the exchanges span a few minutes.
+*/
+void Focap::startTimestamps()
+{
+    deviceClock.reset();
+    if (!sendCommand(":TS1#"))
+        return;
+    for (int i = 0; i < CLOCK_SYNC_BURST; i++)
+        syncClock();
+}
+
+bool Focap::syncClock()
+{
+    char res[RES_LENGTH] = {0};
+
+    double sent = hostTime();
+    lastClockSync = sent;
+    if (sendCommand(":GU#", res) == false)
+        return false;
+    double received = hostTime();
+
+    uint32_t micros = 0;
+    if (sscanf(res, "%8x", &micros) != 1)
+    {
+        LOGF_ERROR("Unknown error: device clock value (%s)", res);
+        return false;
+    }
+    deviceClock.addExchange(sent, received, micros);
+
+    ClockSyncNP[ClockOffset].setValue(deviceClock.currentOffset() * 1000);
+    ClockSyncNP[ClockDrift].setValue(deviceClock.driftPpm());
+    ClockSyncNP[ClockError].setValue(deviceClock.error() * 1000);
+    ClockSyncNP.setState(IPS_OK);
+    ClockSyncNP.apply();
+    return true;
+}
+
+// Host time a reply's value was sampled at, from its @tttttttt stamp or else the time it arrived
+double Focap::sampleTime(const char *response)
+{
+    const char *stamp = strchr(response, '@');
+    uint32_t micros = 0;
+    if (stamp && deviceClock.isValid() && sscanf(stamp + 1, "%8x", &micros) == 1)
+        return deviceClock.toHost(micros);
+    return hostTime();
+}
+
+// Seconds since the epoch of a host time, for clients that match samples against exposures
+double Focap::wallTime(double time)
+{
+    timeval now;
+    gettimeofday(&now, nullptr);
+    return now.tv_sec + now.tv_usec / 1e6 - (hostTime() - time);
+}
+
+// Sample times go out with the values they belong to, not on every poll
+void Focap::publishSampleTimes(bool position, bool temperature)
+{
+    if (!position && !temperature)
+        return;
+    if (position)
+        SampleTimeNP[PositionTime].setValue(wallTime(positionTime));
+    if (temperature)
+        SampleTimeNP[TemperatureTime].setValue(wallTime(temperatureTime));
+    SampleTimeNP.setState(deviceClock.isValid() ? IPS_OK : IPS_IDLE);
+    publish(SampleTimeNP, 0, true);
+}
+
+void Focap::setEta(double seconds)
+{
+    seconds = std::max(0.0, seconds);
+    FocusEtaNP[0].setValue(seconds);
+    FocusEtaNP.setState(seconds > 0 ? IPS_BUSY : IPS_IDLE);
+    publish(FocusEtaNP, ETA_DEADBAND);
+}
+
+void Focap::startExtrapolation()
+{
+    if (extrapolateTimerID < 0)
+        extrapolateTimerID = IEAddTimer(EXTRAPOLATE_INTERVAL, &Focap::extrapolateHelper, this);
+}
+
+void Focap::extrapolateHelper(void *context)
+{
+    static_cast<Focap *>(context)->extrapolate();
+}
+
+/*
+Publishes the modelled position between polls, the serial line stays quiet until the next
+real reading or the predicted arrival.
+*/
+void Focap::extrapolate()
+{
+    extrapolateTimerID = -1;
+
+    double now = hostTime();
+    if (!isConnected() || FocusAbsPosNP.getState() != IPS_BUSY || !motion.isMoving(now))
+        return;
+
+    FocusAbsPosNP[0].setValue(round(motion.positionAt(now)));
+    publish(FocusAbsPosNP, PublishNP[PositionDeadband].getValue());
+    setEta(motion.arrivalTime() - now);
+
+    startExtrapolation();
+}
+
+void Focap::addFocusSample(double temperature, double position)
+{
+    if (focusSamples.size() >= MAX_FOCUS_SAMPLES)
+        focusSamples.pop_front();
+    focusSamples.push_back({temperature, position});
+
+    LOGF_INFO("Added focus sample %.0f at %.2f °C.", position, temperature);
+    fitTemperatureCoefficient();
+}
+
+/*
+Robust (bisquare) linear fit of best focus position against temperature. The slope is the
+temperature coefficient in steps per degree, a single bad autofocus run barely moves it.
+*/
+bool Focap::fitTemperatureCoefficient()
+{
+    const size_t n = focusSamples.size();
+    CoefficientFitNP[FitSamples].setValue(n);
+
+    if (n < 3)
+    {
+        CoefficientFitNP[FitCoefficient].setValue(0);
+        CoefficientFitNP[FitConfidence].setValue(0);
+        CoefficientFitNP.setState(IPS_IDLE);
+        CoefficientFitNP.apply();
+        return false;
+    }
+
+    gsl_matrix *X = gsl_matrix_alloc(n, 2);
+    gsl_vector *y = gsl_vector_alloc(n);
+    gsl_vector *c = gsl_vector_alloc(2);
+    gsl_matrix *cov = gsl_matrix_alloc(2, 2);
+    gsl_multifit_robust_workspace *work = gsl_multifit_robust_alloc(gsl_multifit_robust_bisquare, n, 2);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        gsl_matrix_set(X, i, 0, 1.0);
+        gsl_matrix_set(X, i, 1, focusSamples[i].temperature);
+        gsl_vector_set(y, i, focusSamples[i].position);
+    }
+
+    // All samples at the same temperature leave the slope undetermined
+    int rc = gsl_multifit_robust(X, y, c, cov, work);
+    bool success = (rc == GSL_SUCCESS) && std::isfinite(gsl_vector_get(c, 1));
+
+    if (success)
+    {
+        double slope = gsl_vector_get(c, 1);
+        double error = sqrt(gsl_matrix_get(cov, 1, 1));
+        double confidence = gsl_cdf_tdist_Pinv(0.975, n - 2) * error;
+
+        CoefficientFitNP[FitCoefficient].setValue(slope);
+        CoefficientFitNP[FitConfidence].setValue(std::isfinite(confidence) ? confidence : 0);
+        CoefficientFitNP.setState(IPS_OK);
+        LOGF_DEBUG("Fitted temperature coefficient %.2f ± %.2f steps/°C from %zu samples.", slope, confidence, n);
+    }
+    else
+    {
+        // Don't leave the previous fit around to be applied
+        LOG_WARN("Unable to fit temperature coefficient, samples need a spread in temperature.");
+        CoefficientFitNP[FitCoefficient].setValue(0);
+        CoefficientFitNP[FitConfidence].setValue(0);
+        CoefficientFitNP.setState(IPS_ALERT);
+    }
+
+    gsl_multifit_robust_free(work);
+    gsl_matrix_free(cov);
+    gsl_vector_free(c);
+    gsl_vector_free(y);
+    gsl_matrix_free(X);
+
+    CoefficientFitNP.apply();
+    return success;
+}
+
+bool Focap::setTelemetry(bool enable)
+{
+    telemetry.close();
+    if (!enable)
+        return true;
+
+    if (!telemetry.open(TelemetryTP[0].getText(), getDeviceName()))
+    {
+        LOGF_ERROR("Unable to open telemetry log in %s: %s", TelemetryTP[0].getText(), strerror(errno));
+        return false;
+    }
+
+    LOGF_INFO("Recording telemetry to %s", telemetry.fileName().c_str());
+    return true;
+}
+
+bool Focap::setTrace(bool enable)
+{
+    // Every client connecting reloads the config, don't truncate a running trace
+    if (enable && trace.isOpen())
+        return true;
+
+    trace.close();
+    if (!enable)
+        return true;
+
+    if (!trace.open(TraceTP[0].getText(), getDeviceName()))
+    {
+        LOGF_ERROR("Unable to open trace %s: %s", TraceTP[0].getText(), strerror(errno));
+        return false;
+    }
+
+    LOGF_INFO("Recording serial traffic to %s", TraceTP[0].getText());
+    return true;
+}
+
+void Focap::recordTelemetry()
+{
+    TelemetrySample sample {};
+    sample.timestamp = static_cast<uint64_t>(wallTime(positionTime > 0 ? positionTime : hostTime()) * 1e6);
+    sample.position = static_cast<int32_t>(FocusAbsPosNP[0].getValue());
+    sample.target = static_cast<int32_t>(targetPos);
+    sample.temperature = static_cast<int16_t>(lround(TemperatureNP[0].getValue() * 100.0));
+    sample.flags = (focuserState ? TELEMETRY_MOVING : 0) | (lightState ? TELEMETRY_LIGHT : 0);
+    sample.cover = coverState;
+    sample.brightness = static_cast<uint8_t>(LightIntensityNP[0].getValue());
+
+    if (!telemetry.record(sample))
+    {
+        LOG_ERROR("Unable to write telemetry, recording stopped.");
+        telemetry.close();
+        TelemetrySP.reset();
+        TelemetrySP[INDI_DISABLED].setState(ISS_ON);
+        TelemetrySP.setState(IPS_ALERT);
+        TelemetrySP.apply();
+    }
+}
+
+/*
+Sends a polled property only if the filter says it changed, forced sends are recorded so the
+next poll compares against what clients actually have. Returns whether it went out.
+*/
+bool Focap::publish(INDI::PropertyNumber &property, double deadband, bool force)
+{
+    std::vector<double> values;
+    for (size_t i = 0; i < property.size(); i++)
+        values.push_back(property[i].getValue());
+
+    if (force)
+        publisher.sentNumber(property.getName(), property.getState(), values, hostTime());
+    else if (!publisher.numberChanged(property.getName(), property.getState(), values, deadband, hostTime()))
+        return false;
+    property.apply();
+    return true;
+}
+
+void Focap::publish(INDI::PropertySwitch &property, bool force)
+{
+    std::string states;
+    for (size_t i = 0; i < property.size(); i++)
+        states += (property[i].getState() == ISS_ON) ? '1' : '0';
+
+    if (force)
+        publisher.sentText(property.getName(), property.getState(), states, hostTime());
+    else if (!publisher.textChanged(property.getName(), property.getState(), states, hostTime()))
+        return;
+    property.apply();
+}
+
+void Focap::publish(ITextVectorProperty &property, bool force)
+{
+    std::string text;
+    for (int i = 0; i < property.ntp; i++)
+        text += std::string(property.tp[i].text ? property.tp[i].text : "") + '\n';
+
+    if (force)
+        publisher.sentText(property.name, property.s, text, hostTime());
+    else if (!publisher.textChanged(property.name, property.s, text, hostTime()))
+        return;
+    IDSetText(&property, nullptr);
+}
+
+void Focap::applyPublishOptions()
+{
+    publisher.setMinInterval(PublishNP[MinInterval].getValue() / 1000.0);
+}
+
+void Focap::publishStats()
+{
+    lastStatsTime = hostTime();
+    double sent = publisher.sentCount(), saved = publisher.savedCount();
+    if (sent == PublishStatsNP[MessagesSent].getValue() && saved == PublishStatsNP[MessagesSaved].getValue())
+        return;
+
+    PublishStatsNP[MessagesSent].setValue(sent);
+    PublishStatsNP[MessagesSaved].setValue(saved);
+    PublishStatsNP.apply();
 }
 
 bool Focap::getBrightness()
@@ -936,48 +2760,108 @@ bool Focap::SetLightBoxBrightness(uint16_t value)
 
 bool Focap::AbortFocuser()
 {
-    return sendCommand(":FQ#");
+    if (!sendCommand(":FQ#"))
+        return false;
+
+    // :FQ# ends homing too
+    if (HomeSP.getState() == IPS_BUSY)
+    {
+        LOG_WARN("Homing aborted.");
+        HomeSP.setState(IPS_IDLE);
+        HomeSP.apply();
+    }
+    if (SequenceSP.getState() == IPS_BUSY)
+    {
+        SequenceSP.setState(IPS_IDLE);
+        SequenceSP.apply();
+    }
+    return true;
 }
 
-bool Focap::sendCommand(const char *command, char *response)
+bool Focap::sendCommand(const char *command, char *response, int length)
 {
     if (isSimulation())
     {
         return true;
     }
+    // Without a link the old descriptor may already belong to another unit's port or a probe
+    if (PortFD < 0)
+    {
+        LOGF_DEBUG("CMD %s dropped, the link is down.", command);
+        return false;
+    }
+
     int nbytes_written = 0, nbytes_read = 0, rc = -1;
-    tcflush(PortFD, TCIOFLUSH);
+    flushPort();
     LOGF_DEBUG("CMD %s", command);
 
+    uint64_t sent = trace.command(command);
     if ((rc = tty_write_string(PortFD, command, &nbytes_written)) != TTY_OK)
     {
         char errstr[MAXRBUF] = {0};
         tty_error_msg(rc, errstr, MAXRBUF);
         LOGF_ERROR("Serial write error: %s.", errstr);
+        trace.error(sent, errstr);
+        linkFailures++;
         return false;
     }
 
     if (response == nullptr)
     {
         tcdrain(PortFD);
+        trace.written(sent);
+        linkFailures = 0;
         return true;
     }
 
-    if ((rc = tty_nread_section(PortFD, response, RES_LENGTH - 1, '#', ML_TIMEOUT, &nbytes_read)) != TTY_OK)
+    long timeout = replyTimeout(command);
+    if ((rc = tty_nread_section_expanded(PortFD, response, length - 1, '#', timeout / 1000000, timeout % 1000000,
+                                         &nbytes_read)) != TTY_OK)
     {
         char errstr[MAXRBUF] = {0};
         tty_error_msg(rc, errstr, MAXRBUF);
         LOGF_ERROR("Serial read error: %s.", errstr);
+        trace.error(sent, errstr);
+        linkFailures++;
         return false;
     }
 
     response[nbytes_read - 1] = 0;
+    trace.response(sent, response);
+    linkFailures = 0;
 
     LOGF_DEBUG("RES %s", response);
-    tcflush(PortFD, TCIOFLUSH);
+    flushPort();
     return true;
 }
 
+/*
+All units share the event loop, a unit that doesn't answer holds up the others for as long as it
+is waited for. The firmware answers within milliseconds apart from the temperature conversion, only
+a user's connect gets the long timeout for a unit that is still booting.
+*/
+long Focap::replyTimeout(const char *cmd)
+{
+    if (handshaking && !linkLost)
+        return ML_TIMEOUT * 1000000L;
+    if (!strcmp(cmd, ":GT#"))
+        return TEMPERATURE_TIMEOUT;
+    return POLL_TIMEOUT;
+}
+
+void Focap::flushPort()
+{
+    if (getActiveConnection() != tcpConnection)
+    {
+        tcflush(PortFD, TCIOFLUSH);
+        return;
+    }
+
+    // Sockets have no tcflush, drop whatever a late reply left behind
+    char discard[RES_LENGTH];
+    while (recv(PortFD, discard, sizeof(discard), MSG_DONTWAIT) > 0) {}
+}
+
 void Focap::parkTimeoutHelper(void *context)
 {
     static_cast<Focap *>(context)->parkTimeout();
@@ -990,18 +2874,45 @@ void Focap::unparkTimeoutHelper(void *context)
 
 void Focap::parkTimeout()
 {
+    parkTimeoutID = -1;
     if (ParkCapSP.getState() == IPS_BUSY)
     {
-        LOG_WARN("Parking cap timed out. Retrying...");
-        ParkCap();
+        if (coverRetries++ < COVER_RETRIES)
+        {
+            LOG_WARN("Parking cap timed out. Retrying...");
+            if (flatsPending)
+                startFlats();
+            else
+                ParkCap();
+            return;
+        }
+        LOG_ERROR("Parking cap timed out.");
+        coverRetries = 0;
+        ParkCapSP.setState(IPS_ALERT);
+        ParkCapSP.apply();
+        if (flatsPending)
+        {
+            flatsPending = false;
+            FlatSessionSP.setState(IPS_ALERT);
+            FlatSessionSP.apply();
+        }
     }
 }
 
 void Focap::unparkTimeout()
 {
+    unparkTimeoutID = -1;
     if (ParkCapSP.getState() == IPS_BUSY)
     {
-        LOG_WARN("UnParking cap timed out. Retrying...");
-        UnParkCap();
+        if (coverRetries++ < COVER_RETRIES)
+        {
+            LOG_WARN("UnParking cap timed out. Retrying...");
+            UnParkCap();
+            return;
+        }
+        LOG_ERROR("UnParking cap timed out.");
+        coverRetries = 0;
+        ParkCapSP.setState(IPS_ALERT);
+        ParkCapSP.apply();
     }
 }
\ No newline at end of file
@@ -5,15 +5,27 @@
 #include "indidustcapinterface.h"
 #include "indifocuserinterface.h"
 
+#include "focap_clock.h"
+#include "focap_motion.h"
+#include "focap_publish.h"
+#include "focap_telemetry.h"
+#include "focap_trace.h"
+
 #include <stdint.h>
 #include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
 
 class Focap : public INDI::DefaultDevice, public INDI::LightBoxInterface, public INDI::DustCapInterface, public INDI::FocuserInterface
 {
     public:
-        Focap();
+        explicit Focap(uint8_t index = 0);
         virtual ~Focap() = default;
 
+        static constexpr const char * DEFAULT_NAME = "Gastro Focap";
+        static const uint8_t MAX_DEVICES { 8 };
+
         const char* getDefaultName() override;
 
         virtual bool initProperties() override;
@@ -28,16 +40,19 @@ class Focap : public INDI::DefaultDevice, public INDI::LightBoxInterface, public
         static void parkTimeoutHelper(void* context);
         static void unparkTimeoutHelper(void* context);
 
-        static void timedMoveHelper(void* context);
+        static void extrapolateHelper(void* context);
 
     protected:
         // From INDI::FocuserInterface
         virtual IPState MoveAbsFocuser(uint32_t targetTicks) override;
         virtual IPState MoveRelFocuser(FocusDirection dir, uint32_t ticks) override;
+        virtual IPState MoveFocuser(FocusDirection dir, int speed, uint16_t duration) override;
+        virtual bool SetFocuserMaxPosition(uint32_t ticks) override;
         virtual bool SyncFocuser(uint32_t ticks) override;
         bool AbortFocuser() override;
 
         // From INDI::DefaultDevice
+        bool Connect() override;
         void TimerHit() override;
         bool saveConfigItems(FILE* fp) override;
 
@@ -55,6 +70,7 @@ class Focap : public INDI::DefaultDevice, public INDI::LightBoxInterface, public
         bool getStartupData();
         bool ping();
         bool getStatus();
+        static const char *faultName(uint8_t fault);
         bool getFirmwareVersion();
         bool getBrightness();
         bool getParkAngle();
@@ -66,6 +82,25 @@ class Focap : public INDI::DefaultDevice, public INDI::LightBoxInterface, public
         int parkTimeoutID { -1 };
         void unparkTimeout();
         int unparkTimeoutID { -1 };
+        uint8_t coverRetries { 0 };
+
+        double coverMoveTime();
+        void scheduleCoverTimeout(bool park);
+        void cancelCoverTimeout();
+        bool getServoProfile();
+        bool setServoProfile(uint16_t speed, uint16_t acceleration);
+
+        // Cover and light in one command, the firmware turns the light on once the cover is parked
+        bool startFlats();
+        bool finishFlats();
+        bool flatsPending { false };
+        double flatsReadyTime { 0 };                        // host time the cover should be parked
+        INDI::PropertySwitch FlatSessionSP {2};
+        enum
+        {
+            FlatsStart,
+            FlatsFinish
+        };
 
         ITextVectorProperty StatusTP;
         IText StatusT[4] {};
@@ -76,32 +111,89 @@ class Focap : public INDI::DefaultDevice, public INDI::LightBoxInterface, public
         INumber AnglesN[2];
         INumberVectorProperty AnglesNP;
 
+        INDI::PropertyText UnitTP {2};
+        enum
+        {
+            UnitId,
+            LastPort
+        };
+
+        INDI::PropertyNumber ServoProfileNP {2};
+        enum
+        {
+            ServoSpeed,
+            ServoAcceleration
+        };
+
         int PortFD{ -1 };
         uint16_t productID{ 0 };
 
         uint8_t simulationWorkCounter{ 0 };
 
         Connection::Serial *serialConnection{ nullptr };
+        Connection::TCP *tcpConnection{ nullptr };
 
         bool Ack();
-        bool sendCommand(const char* cmd, char* res = nullptr);
+        bool hasUnitId();
+        std::string discoverPort();
+
+        // Link recovery: after LINK_FAILURE_LIMIT failed commands in a row the poll timer reopens
+        // the port instead, backing off from RECONNECT_MIN_DELAY to RECONNECT_MAX_DELAY
+        bool reconnect();
+        void resync();
+        uint8_t linkFailures { 0 };
+        bool linkLost { false };
+        bool handshaking { false };
+        bool autoSearchWanted { true };
+        void setAutoSearch(bool enable);
+        long replyTimeout(const char* cmd);
+        uint32_t reconnectDelay { 0 };
+        void rememberUnit(const char* port);
+        bool sendCommand(const char* cmd, char* res = nullptr, int length = RES_LENGTH);
+        void flushPort();
 
         void GetFocusParams();
         bool readTemperature();
 		bool readTemperatureCoefficient();
         bool readPosition();
+        bool readMotion();
+        static double hostTime();
+        void setEta(double seconds);
+        void startExtrapolation();
+        void extrapolate();
         bool isMoving();
 
         bool MoveFocuser(uint32_t position);
         bool setTemperatureCalibration(double calibration);
         bool setTemperatureCoefficient(double coefficient);
         bool setTemperatureCompensation(bool enable);
-        void timedMoveCallback();
+        void updateTimedMove(bool moving);
+        bool startHoming();
+        void updateHoming();
+
+        bool readLoopProfile();
+        bool getMotorCurrents();
+        bool setMotorCurrents();
+        void restoreMotorCurrents();
+
+        void addFocusSample(double temperature, double position);
+        bool fitTemperatureCoefficient();
+
+        bool setTelemetry(bool enable);
+        void recordTelemetry();
+        bool setTrace(bool enable);
+
+        bool publish(INDI::PropertyNumber &property, double deadband, bool force = false);
+        void publish(INDI::PropertySwitch &property, bool force = false);
+        void publish(ITextVectorProperty &property, bool force = false);
+        void applyPublishOptions();
+        void publishStats();
 
         static constexpr const char * FOCUSER_TAB = "Focuser";
         static constexpr const char * FLATCAP_TAB = "Flatcap";
+        static constexpr const char * DIAGNOSTICS_TAB = "Diagnostics";
 
-        uint32_t targetPos { 0 }, lastPos { 0 }, lastTemperature { 0 };
+        uint32_t targetPos { 0 };
 
         INDI::PropertyNumber TemperatureNP {1};
 
@@ -114,6 +206,185 @@ class Focap : public INDI::DefaultDevice, public INDI::LightBoxInterface, public
 
         INDI::PropertySwitch TemperatureCompensateSP {2};
 
-        static const uint8_t RES_LENGTH { 32 };
-        static const uint8_t ML_TIMEOUT { 3 };
+        MotionModel motion;
+        int extrapolateTimerID { -1 };
+        int firmwareVersion { 0 };
+        double timedMoveEnd { 0 };                          // host time a firmware timed move runs out
+
+        // Sensorless homing against the inner stop, the firmware reports its phase with :GZ#
+        INDI::PropertySwitch HomeSP {1};
+        uint8_t homeState { 0 };
+
+        // Autofocus sweep run by the firmware: the targets are uploaded once, :QN# starts each step
+        // and the firmware approaches every target from the same side
+        bool loadSequence(const char* text);
+        bool uploadSequence();
+        bool nextSequenceStep();
+        void checkSequence();
+        void updateSequenceState();
+        std::vector<uint32_t> sequenceTargets;
+        size_t sequenceNext { 0 };                          // step the next :QN# starts
+        size_t sequenceFirst { 0 };                         // step the firmware's step 0 is, after uploading the rest
+        INDI::PropertyText SequenceTP {1};
+        INDI::PropertyNumber SequenceApproachNP {1};
+        INDI::PropertySwitch SequenceSP {2};
+        enum
+        {
+            SequenceNext,
+            SequenceRestart
+        };
+        INDI::PropertyNumber SequenceStateNP {2};
+        enum
+        {
+            SequenceStep,
+            SequenceSteps
+        };
+        INDI::PropertyNumber FocusEtaNP {1};
+
+        // Stamped replies: the device clock mapped onto the host's, and when the last values were sampled
+        void startTimestamps();
+        bool syncClock();
+        double sampleTime(const char* response);
+        static double wallTime(double time);
+        void publishSampleTimes(bool position, bool temperature);
+        ClockSync deviceClock;
+        double lastClockSync { 0 };
+        double positionTime { 0 }, temperatureTime { 0 };  // host times
+        INDI::PropertyNumber SampleTimeNP {2};
+        enum
+        {
+            PositionTime,
+            TemperatureTime
+        };
+        INDI::PropertyNumber ClockSyncNP {3};
+        enum
+        {
+            ClockOffset,
+            ClockDrift,
+            ClockError
+        };
+
+        // Firmware loop profiler, one min/avg/max triple per phase plus the longest gap between steps
+        static const int LOOP_PHASES { 6 };
+        static const int LOOP_BUCKETS { 8 };
+        INDI::PropertyNumber LoopTimingNP {LOOP_PHASES * 3 + 1};
+        INDI::PropertyNumber LoopHistogramNP {LOOP_BUCKETS};
+        INDI::PropertySwitch LoopProfileSP {1};
+
+        INDI::PropertyNumber MotorCurrentNP {4};
+        enum
+        {
+            RunCurrent,
+            HoldCurrent,
+            HoldDelay,
+            PowerDown
+        };
+
+        INDI::PropertySwitch IdleModeSP {2};
+        enum
+        {
+            IdleHold,
+            IdleDisable
+        };
+
+        // (temperature, best focus) pairs for fitting the temperature coefficient
+        struct FocusSample
+        {
+            double temperature;
+            double position;
+        };
+        std::deque<FocusSample> focusSamples;
+        static const size_t MAX_FOCUS_SAMPLES { 200 };
+
+        INDI::PropertyNumber FocusSampleNP {2};
+        enum
+        {
+            SampleTemperature,
+            SamplePosition
+        };
+
+        INDI::PropertySwitch CoefficientFitSP {3};
+        enum
+        {
+            FitAddCurrent,
+            FitApply,
+            FitClear
+        };
+
+        INDI::PropertyNumber CoefficientFitNP {3};
+        enum
+        {
+            FitCoefficient,
+            FitConfidence,
+            FitSamples
+        };
+
+        INDI::PropertySwitch TelemetrySP {2};
+        INDI::PropertyText TelemetryTP {1};
+        TelemetryRecorder telemetry;
+
+        INDI::PropertySwitch TraceSP {2};
+        INDI::PropertyText TraceTP {1};
+        TraceRecorder trace;
+
+        // Polled properties only go out when they changed by more than these
+        PublishFilter publisher;
+        INDI::PropertyNumber PublishNP {3};
+        enum
+        {
+            PositionDeadband,
+            TemperatureDeadband,
+            MinInterval
+        };
+        INDI::PropertyNumber PublishStatsNP {2};
+        enum
+        {
+            MessagesSent,
+            MessagesSaved
+        };
+        double lastStatsTime { 0 };
+        uint8_t focuserState { 0 }, lightState { 0 }, coverState { 0 }, focuserFault { 0 };
+
+        INDI::PropertyNumber DeviceCountNP {1};
+        uint8_t deviceIndex { 0 };
+
+        // Focuser fault codes reported in the status reply, same as enum faults in the firmware
+        enum
+        {
+            NO_FAULT,
+            FAULT_SLIP,
+            FAULT_STALL,
+            FAULT_ENCODER,
+            FAULT_HOME
+        };
+
+        static const uint8_t RES_LENGTH { 48 };
+        static const uint8_t PROFILE_LENGTH { 128 };
+        static const uint8_t COVER_RETRIES { 1 };
+        static constexpr double POWER_DOWN_MS { 21.8 };
+        static const int SERVO_PROFILE_FIRMWARE { 3 };       // first firmware with >W#, >X#, >Y# and >U#
+        static const int CURRENTS_FIRMWARE { 3 };            // first firmware with :GH#, :SR#, :SH#, :SD#, :SW# and :SM#
+        static const int MOTION_FIRMWARE { 3 };              // first firmware with :GM#
+        static const int PROFILE_FIRMWARE { 4 };             // first firmware with :GL#
+        static const int NATIVE_MOVE_FIRMWARE { 5 };         // first firmware with :MR#, :MT# and :SL#
+        static const int FLATS_FIRMWARE { 6 };               // first firmware with >F# and >E#
+        static const int HOMING_FIRMWARE { 7 };              // first firmware with :PH# and :GZ#
+        static const int TIMESTAMP_FIRMWARE { 8 };           // first firmware with :GU# and :TS#
+        static const int SEQUENCE_FIRMWARE { 9 };            // first firmware with :QA#, :QN# and the rest
+        static const size_t MAX_SEQUENCE_STEPS { 32 };       // SEQUENCE_MAX_STEPS in the firmware
+        static const int EXTRAPOLATE_INTERVAL { 100 };       // ms between modelled position updates
+        static constexpr double ETA_DEADBAND { 0.05 };       // s
+        static constexpr double TIMER_DEADBAND { 100 };      // ms
+        static const int STATS_INTERVAL { 10 };              // s between publish counter updates
+        static const int CLOCK_SYNC_INTERVAL { 10 };         // s between :GU# exchanges
+        static const int CLOCK_SYNC_BURST { 5 };             // exchanges right after connecting
+        static const uint32_t MIN_POLL_PERIOD { 20 };
+        static const uint32_t ARRIVAL_MARGIN { 20 };         // ms after the predicted arrival to poll at
+        static constexpr double COVER_TIMEOUT_MARGIN { 2.0 };
+        static const uint8_t ML_TIMEOUT { 3 };               // s, handshake on connect only
+        static const uint32_t POLL_TIMEOUT { 300000 };        // us, everything else
+        static const uint32_t TEMPERATURE_TIMEOUT { 1000000 };// us, :GT# waits for the 750 ms DS18B20 conversion
+        static const uint8_t LINK_FAILURE_LIMIT { 3 };
+        static const uint32_t RECONNECT_MIN_DELAY { 1000 };  // ms
+        static const uint32_t RECONNECT_MAX_DELAY { 30000 }; // ms
 };
\ No newline at end of file
@@ -0,0 +1,4 @@
+// Copy to wifi_credentials.h next to esp32.ino, it is in .gitignore and stays out of the repository
+#define WIFI_SSID "your-network"
+#define WIFI_PASSWORD "your-password"
+//#define WIFI_HOSTNAME "focap2"		// default focap, reachable as focap.local, unique per unit